@@ -1,12 +1,23 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mount.h>
 #include <sys/reboot.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "djb/str.h"
 
 #define ABORTMSG "hard-reboot aborted.\n"
-#define USAGE "Say 'hard-reboot (RESTART|HALT|POWER_OFF)' if you really mean it.\n"
+#define USAGE "Say 'hard-reboot [-t SECONDS] (RESTART|HALT|POWER_OFF)' if you really mean it.\n"
+
+static char **mnt; /* mount points in mount order */
+static int nmnt;
 
 void usage(void) {
   if (write(2, ABORTMSG, str_len(ABORTMSG)) < 0) {
@@ -18,24 +29,209 @@ void usage(void) {
   exit(1);
 }
 
+static void warn(const char *s, const char *mp) {
+  if (write(2, s, str_len(s)) < 0 || write(2, mp, str_len(mp)) < 0 || write(2, "\n", 1) < 0) {
+    exit(2);
+  }
+}
+
+static unsigned long msnow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* decode the octal escapes of a mountinfo field in place */
+static char *unescape(char *s) {
+  char *in = s, *out = s;
+  while (*in) {
+    if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] && in[3]) {
+      *out++ = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+      in += 4;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  *out = 0;
+  return s;
+}
+
+/* read the mount points from /proc/self/mountinfo */
+static int readmounts() {
+  unsigned long len = 0, alloc = 0;
+  char *buf = 0;
+  long r;
+  int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  do {
+    if (len == alloc) {
+      char *b = (char *)realloc(buf, (alloc = alloc * 2 + 4096) + 1);
+      if (!b) {
+        close(fd);
+        return -1;
+      }
+      buf = b;
+    }
+    r = read(fd, buf + len, alloc - len);
+    len += r > 0 ? r : 0;
+  } while (r > 0);
+  close(fd);
+  buf[len] = 0;
+  for (char *line = buf; *line;) {
+    char *end = strchr(line, '\n');
+    char *field = line;
+    if (end) {
+      *end++ = 0;
+    } else {
+      end = line + str_len(line);
+    }
+    /* mount ID, parent ID, major:minor, root, mount point */
+    for (int i = 0; i < 4 && field; ++i) {
+      field = strchr(field, ' ');
+      field = field ? field + 1 : 0;
+    }
+    if (field) {
+      char **m = (char **)realloc(mnt, (nmnt + 1) * sizeof(char *));
+      if (!m) {
+        return -1;
+      }
+      mnt = m;
+      field[str_chr(field, ' ')] = 0;
+      mnt[nmnt++] = unescape(field);
+    }
+    line = end;
+  }
+  return 0;
+}
+
+/* run op on the mount points in children writing the index done to a pipe,
+ * wait until deadline, kill the children still running and return a map of
+ * the mount points done */
+static char *runall(int (*op)(int), int parallel, unsigned long deadline) {
+  char *done = (char *)calloc(nmnt + 1, 1);
+  pid_t *pids = (pid_t *)calloc(nmnt + 1, sizeof(pid_t));
+  int fd[2];
+  if (!done || !pids || pipe(fd)) {
+    free(pids);
+    return done;
+  }
+  for (int i = 0; i < nmnt; ++i) {
+    pid_t pid = pids[i] = fork();
+    if (pid == 0) {
+      close(fd[0]);
+      for (int j = i; parallel ? j == i : j < nmnt; ++j) {
+        int k = parallel ? j : nmnt - 1 - j;
+        if (!op(k) && write(fd[1], &k, sizeof k) < 0) {
+          _exit(1);
+        }
+      }
+      _exit(0);
+    }
+    if (!parallel || pid < 0) {
+      break;
+    }
+  }
+  close(fd[1]);
+  for (;;) {
+    struct pollfd pfd = {fd[0], POLLIN, 0};
+    int k;
+    long left = (long)(deadline - msnow());
+    if (left <= 0 || poll(&pfd, 1, left) <= 0 || read(fd[0], &k, sizeof k) != sizeof k) {
+      break; /* timeout or all children done */
+    }
+    if (k >= 0 && k < nmnt) {
+      done[k] = 1;
+    }
+  }
+  close(fd[0]);
+  /* a child stuck in the kernel goes once its call returns, it must not
+   * carry on behind the back of the next phase or the reboot */
+  for (int i = 0; i < nmnt; ++i) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGKILL);
+      waitpid(pids[i], 0, WNOHANG);
+    }
+  }
+  free(pids);
+  return done;
+}
+
+static int dosync(int i) {
+  int fd = open(mnt[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int ret = -1;
+  if (fd >= 0) {
+    ret = syncfs(fd);
+    close(fd);
+  }
+  return ret;
+}
+
+static int doumount(int i) {
+  if (!umount2(mnt[i], 0)) {
+    return 0;
+  }
+  return mount(0, mnt[i], 0, MS_REMOUNT | MS_RDONLY, 0);
+}
+
+/* sync all filesystems in parallel within half of timeout, unmount or
+ * remount them read-only in reverse mount order in the rest, give up on
+ * what is not done at the deadline of each phase */
+void shutdownmounts(unsigned long timeout) {
+  unsigned long now = msnow();
+  unsigned long deadline = now + timeout;
+  char *done;
+  if (readmounts()) {
+    sync();
+    return;
+  }
+  done = runall(dosync, 1, now + timeout / 2);
+  for (int i = 0; done && i < nmnt; ++i) {
+    if (!done[i]) {
+      warn("hard-reboot: not synced ", mnt[i]);
+    }
+  }
+  free(done);
+  done = runall(doumount, 0, deadline);
+  for (int i = nmnt - 1; done && i >= 0; --i) {
+    if (!done[i]) {
+      warn("hard-reboot: skipped ", mnt[i]);
+    }
+  }
+  free(done);
+}
+
 int main(int argc, char *argv[]) {
+  unsigned long timeout = 0;
+  int how;
+  if (argc == 4 && strcmp(argv[1], "-t") == 0) {
+    timeout = atoi(argv[2]) * 1000UL;
+    argv += 2;
+    argc -= 2;
+  }
   if (argc != 2) {
     usage();
   }
-
-  sync();
-  sync();
-  sync();
   if (strcmp(argv[1], "RESTART") == 0) {
-    reboot(RB_AUTOBOOT);
+    how = RB_AUTOBOOT;
   } else if (strcmp(argv[1], "HALT") == 0) {
-    reboot(RB_HALT_SYSTEM);
+    how = RB_HALT_SYSTEM;
   } else if (strcmp(argv[1], "POWER_OFF") == 0) {
-    reboot(RB_POWER_OFF);
+    how = RB_POWER_OFF;
   } else {
     usage();
   }
 
+  if (timeout) {
+    shutdownmounts(timeout);
+  } else {
+    sync();
+    sync();
+    sync();
+  }
+  reboot(how);
+
   while (1) {
     sleep(10);
   }
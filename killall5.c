@@ -6,27 +6,209 @@ own  session, so  it  won't kill the shell that is running the
 script it was called from. Its primary (only) use is in the rc
 scripts found in the /etc/init.d directory.
 
+With -w SECONDS killall5 waits until the signaled processes have
+exited, at most SECONDS. Processes still alive after that are sent
+a KILL signal and listed on stderr. Processes are tracked by pidfd,
+so a recycled pid is never signaled or waited for.
+
 This program is free software; you can redistribute it and/or
 modify it under the terms of the GNU General Public License
 as published by the Free Software Foundation; either version
 2 of the License, or (at your option) any later version.
 */
 
-#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define USAGE "Usage: killall5 SIGNAL\n"
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+#define USAGE "Usage: killall5 [-w SECONDS] SIGNAL\n"
 #define NOPROC "No processes found - /proc not mounted?\n"
 
+#define TICK 100 /* poll interval (ms) for processes without a pidfd */
+
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+typedef struct {
+  pid_t pid;
+  int fd; /* -1 if no pidfd could be opened */
+} proc_t;
+
+static proc_t *procs;
+static int nprocs, procs_alloc;
+
+static void err(const char *s) {
+  const char *e = s;
+  while (*e) {
+    ++e;
+  }
+  if (write(2, s, e - s) < 0) {
+    exit(2);
+  }
+}
+
+static unsigned long msnow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a process of session 0 is a kernel thread if it has no command line,
+ * name is its directory in /proc */
+static int kthread(int dirfd, const char *name) {
+  char fn[32], c;
+  int i = 0;
+  for (; name[i] && i < 20; ++i) {
+    fn[i] = name[i];
+  }
+  fn[i] = 0;
+  for (const char *x = "/cmdline"; (fn[i] = *x); ++i, ++x) {
+  }
+  int fd = openat(dirfd, fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 1; /* gone */
+  }
+  int n = read(fd, &c, 1);
+  close(fd);
+  return n <= 0;
+}
+
+/* signal pid, keep track of it if wait is set */
+static void sendsig(pid_t pid, int signal, int wait) {
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd < 0) {
+    kill(pid, signal);
+  } else if (syscall(SYS_pidfd_send_signal, fd, signal, 0, 0) && errno == ESRCH) {
+    close(fd);
+    return;
+  }
+  if (!wait) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  if (nprocs == procs_alloc) {
+    proc_t *p = (proc_t *)realloc(procs, (procs_alloc * 2 + 64) * sizeof(proc_t));
+    if (!p) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+    procs = p;
+    procs_alloc = procs_alloc * 2 + 64;
+  }
+  procs[nprocs].pid = pid;
+  procs[nprocs].fd = fd;
+  ++nprocs;
+}
+
+/* drop processes that have exited, return 1 if any is left without a pidfd */
+static int sweep(struct pollfd *pfd) {
+  int nofd = 0;
+  int n = 0;
+  for (int i = 0; i < nprocs; ++i) {
+    if (procs[i].fd >= 0 ? pfd[i].revents : kill(procs[i].pid, 0) && errno == ESRCH) {
+      if (procs[i].fd >= 0) {
+        close(procs[i].fd);
+      }
+      continue;
+    }
+    nofd |= procs[i].fd < 0;
+    procs[n++] = procs[i];
+  }
+  nprocs = n;
+  return nofd;
+}
+
+/* wait until all tracked processes are gone or timeout (ms) expired */
+static void waitall(unsigned long timeout) {
+  struct pollfd *pfd = (struct pollfd *)malloc((nprocs + 1) * sizeof(struct pollfd));
+  unsigned long deadline = msnow() + timeout;
+  int nofd = 1;
+  if (!pfd) {
+    return;
+  }
+  while (nprocs) {
+    long left = (long)(deadline - msnow());
+    if (left <= 0) {
+      break;
+    }
+    for (int i = 0; i < nprocs; ++i) {
+      pfd[i].fd = procs[i].fd;
+      pfd[i].events = POLLIN;
+      pfd[i].revents = 0;
+    }
+    if (nofd && left > TICK) {
+      left = TICK;
+    }
+    if (poll(pfd, nprocs, left) < 0 && errno != EINTR) {
+      break;
+    }
+    nofd = sweep(pfd);
+  }
+  free(pfd);
+}
+
+/* kill the processes left, list them on stderr */
+static void killrest() {
+  for (int i = 0; i < nprocs; ++i) {
+    char buf[64];
+    char *x = buf + sizeof buf;
+    pid_t pid = procs[i].pid;
+    if (procs[i].fd >= 0) {
+      syscall(SYS_pidfd_send_signal, procs[i].fd, SIGKILL, 0, 0);
+      close(procs[i].fd);
+    } else {
+      kill(pid, SIGKILL);
+    }
+    *--x = '\n';
+    do {
+      *--x = '0' + pid % 10;
+    } while (pid /= 10);
+    err("killall5: killed ");
+    if (write(2, x, buf + sizeof buf - x) < 0) {
+      exit(2);
+    }
+  }
+}
+
 int main(int argc, char **argv) {
-  struct dirent *dir;
-  DIR *dirstream;
-  register pid_t pid, sid, mypid, mysid;
+  char dirbuf[8192];
+  struct rlimit rl;
+  int dirfd;
+  long len;
+  pid_t pid, sid, mypid, mysid;
   int signal = -1;
+  int wait = 0;
+  unsigned long timeout = 0;
   unsigned int sig_sent = 0;
 
+  if (argc == 4 && argv[1][0] == '-' && argv[1][1] == 'w' && !argv[1][2]) {
+    wait = 1;
+    timeout = atoi(argv[2]) * 1000UL;
+    argv += 2;
+    argc -= 2;
+  }
   if (argc == 2) {
     if (argv[1][0] == '-') {
       argv[1]++;
@@ -35,39 +217,57 @@ int main(int argc, char **argv) {
   }
 
   if ((signal < 1) || (signal > 31)) {
-    if (write(2, USAGE, sizeof USAGE - 1) < 0) {
-      return 2;
-    }
+    err(USAGE);
     return 1;
   }
 
+  if (wait && !getrlimit(RLIMIT_NOFILE, &rl)) {
+    /* one pidfd per process, fall back to polling by pid beyond the limit */
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
   kill(-1, SIGSTOP);
 
-  if ((dirstream = opendir("/proc"))) {
+  if ((dirfd = open("/proc", O_RDONLY | O_DIRECTORY)) >= 0) {
 
     mypid = getpid();
     mysid = getsid(0);
 
-    while ((dir = readdir(dirstream))) {
-      pid = atoi(dir->d_name);
-
-      if (pid > 1) {
+    while ((len = syscall(SYS_getdents64, dirfd, dirbuf, sizeof dirbuf)) > 0) {
+      for (long off = 0; off < len;) {
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(dirbuf + off);
+        char *c = d->d_name;
+        off += d->d_reclen;
+        for (pid = 0; *c >= '0' && *c <= '9'; ++c) {
+          pid = pid * 10 + *c - '0';
+        }
+        if (*c || pid <= 1) {
+          continue;
+        }
         sig_sent = 1;
+        /* getsid is needed for every pid to spare our own session, kernel
+         * threads are told from its result: they are in session 0. Only
+         * then the command line is read, it is empty for kernel threads */
         sid = getsid(pid);
-        if ((pid != mypid) && (sid != mysid)) {
-          kill(pid, signal);
+        if ((pid != mypid) && (sid != mysid) && (sid > 0 || (!sid && !kthread(dirfd, d->d_name)))) {
+          sendsig(pid, signal, wait);
         }
       }
     }
+    close(dirfd);
   }
 
   kill(-1, SIGCONT);
   if (!sig_sent) {
-    if (write(2, NOPROC, sizeof NOPROC - 1) < 0) {
-      return 2;
-    }
+    err(NOPROC);
     return 1;
   }
 
+  if (wait) {
+    waitall(timeout);
+    killrest();
+  }
+
   return 0;
 }
@@ -1,47 +1,231 @@
+#define _GNU_SOURCE /* struct ucred, CPU_SET */
+
 #include <alloca.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <linux/kd.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/reboot.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef USDT
+#include <sys/sdt.h>
+#endif
 
 #include "djb/fmt.h"
 #include "djb/str.h"
 
 #include "neoinit.h"
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/* list of service indexes */
+typedef struct {
+  int *v;
+  int n, alloc;
+} edges_t;
+
+/* fd deposited by a service to get it back when it is started again */
+typedef struct {
+  int fd;
+  char *name;
+} fdstore_t;
+
+/* queue of transient jobs, at most max of them run at once */
 typedef struct {
   char *name;
-  pid_t pid;
-  char respawn;
-  char circular;
-  int state;
+  int max;
+} jobq_t;
+
+/* cold service data, only touched when a service is started or queried */
+typedef struct {
+  edges_t deps;  /* services this one depends on */
+  edges_t rdeps; /* services depending on this one */
   int sid_father;
   int sid_log;
   time_t changed_at;
+  unsigned long started_ms;
+  unsigned long stop_ms; /* deadline to kill a stopping service */
+  pid_t pid_old;         /* previous instance while the service is restarted */
+  int sid_tmpl;          /* template of an instance */
+  int instances;         /* number of instances of a template */
+  int *cpus;             /* CPUs instances are pinned to by index */
+  int ncpus;
+  pid_t pid_standby;     /* parked instance taking over when the service dies */
+  unsigned long standby_ms; /* start of the standby, 0 once neoinit stops it */
+  int pidfd_standby;        /* to notice the exit of the standby at once */
+  int standby_quick;        /* standbys in a row that exited within a second */
+  int pidfd;             /* of a service with a standby or a job, to notice its exit at once */
+  char *job;             /* VAR=val items and command line of a transient job */
+  unsigned long joblen;
+  int queue;             /* of a job */
+  int exitcode;          /* of the last run, 128 + signal if killed, -1 if unknown */
+  unsigned long utime, stime; /* ms of cpu time used by the last run */
+  long maxrss;                /* kB */
+  unsigned long spawns, respawns, failures;
+  unsigned long respawn_us; /* time the service died to be respawned */
+  int *lfd; /* listening sockets passed to the service */
+  int nlfd;
+  fdstore_t *store; /* fds passed to the next instance of the service */
+  int nstore;
+  unsigned long idle;      /* ms without activity before a lazy service is stopped */
+  unsigned long active_ms; /* last activity of a lazy service */
+  unsigned long cpu;       /* cpu time (ticks) at the last activity check */
   int __stdin, __stdout;
 } sv_t;
 
-static sv_t *svlist;
+#define SV_RESPAWN  1
+#define SV_CIRCULAR 2
+#define SV_MAPPED   4
+#define SV_QUEUED   8
+#define SV_QSETUP   16
+#define SV_STOPPING 32
+#define SV_KILLED   64
+#define SV_LAZY     128
+#define SV_WAKE     256
+#define SV_IDLE     512
+#define SV_NOTIFY   1024
+#define SV_READY    2048
+#define SV_TEMPLATE 4096
+#define SV_INSTANCE 8192
+#define SV_STANDBY  16384
+#define SV_JOB      32768
+
+/* service table as structure of arrays, sweeps only touch the arrays they need */
+static struct {
+  pid_t *pid;
+  unsigned char *state;
+  unsigned short *flags;
+  unsigned int *hash;   /* hash of name */
+  unsigned long *name;  /* offset of name in names arena */
+  sv_t *cold;
+} sv;
+
+static char *names; /* arena of all service names */
+static unsigned long names_len, names_alloc;
+static int *sv_index; /* open addressing hash index, sid + 1 */
+static unsigned int sv_slots;
+
+#define svname(sid) (names + sv.name[sid])
+
 static char *confdata;
 
 static int sv_max = -1;
 static int sv_alloc;
 static int iam_init;
+static int subreaper; /* orphaned descendants are reparented to neoinit */
+static pid_t *orphans; /* children not belonging to a service at the last look */
+static int norphans, orphans_alloc;
+static unsigned int nreaped; /* children reaped in this pass of childhandler */
 static int infd, outfd;
 
 #define HISTORY 15
 static int history[HISTORY];
 
+#define READAHEAD NEOROOT "/readahead"
+#define RA_SETTLE 10000 /* ms without a new path after which boot has settled */
+static int ra_enabled;
+static int ra_dirty;
+static unsigned long ra_added; /* msnow() when the last path was recorded */
+static char *ra_data;
+static unsigned long ra_len, ra_alloc;
+static unsigned long *ra_slot;
+static unsigned long ra_slots, ra_used;
+
+#define TICK 100 /* poll interval (ms) while neoinit waits for services */
+#define PSI_INTERVAL 1000
+static int spawn_max;
+static int spawn_limit;
+static int spawn_psi;
+static unsigned long spawn_settle = 1000;
+static unsigned long psi_checked;
+static int *spawning;
+static int nspawning;
+static int *spawnq;
+static int spawnq_len, spawnq_alloc;
+
+#define STOP_TIMEOUT 5
+static int stop_pending;
+static int restart_sid = -1; /* service being restarted, reply pending */
+static int restart_stopping; /* the previous instance has been signaled */
+static int spawn_standby;    /* forkandexec starts a standby instance */
+#define STANDBY_TRIES 5      /* standbys exiting within a second in a row before giving up */
+
+static jobq_t *jobq;
+static int njobq;
+static unsigned long jobs;   /* submitted, numbers the job names */
+#define JOB_KEEP 16          /* finished jobs kept per queue, older ones are reused */
+static struct rusage *reaped; /* usage of the child passed to handlekilled, if known */
+
+#define STATE_VERSION 1 /* of the state passed to a re-executed neoinit */
+#define STATE_FIELDS  29 /* of a service record */
+static char **neo_argv;  /* to execute neoinit again, argv[0] is a path */
+static char *stp, *ste;  /* state being restored */
+
+#define TRACE_EVENTS 1024 /* kept in the trace ring, a power of 2 */
+#define TR_STATE 0        /* a: new state */
+#define TR_FORK  1        /* a: pid */
+#define TR_REAP  2        /* a: pid, b: wait status */
+#define TR_CTL   3        /* a: opcode, b: us to handle it */
+
+/* binary trace event, formatted only when the ring is dumped */
+typedef struct {
+  unsigned long us;
+  int type;
+  int sid;
+  int a, b;
+} trace_t;
+
+static trace_t trace_ring[TRACE_EVENTS];
+static unsigned long traced; /* events recorded since start */
+
+#define HIST_BUCKETS 8 /* upper bounds 10us to 10s by powers of 10 and +Inf */
+#define METRICS_INTERVAL 1000 /* ms between rewrites of the metrics file */
+
+/* latency histogram */
+typedef struct {
+  unsigned long count, sum_us;
+  unsigned long bucket[HIST_BUCKETS];
+} hist_t;
+
+static hist_t respawn_hist; /* from the exit of a service to its respawn */
+static hist_t ctl_hist[128]; /* time to handle a control request by opcode */
+static hist_t loop_hist;    /* main loop iterations, without waiting in poll */
+static int ctl_queued, ctl_queued_max; /* bytes left in the control fifo after a request */
+static char *metrics_path; /* file the metrics are written to, NEO_METRICS */
+static int metrics_dirty;
+static unsigned long metrics_written;
+static char *mtext; /* metrics text being formatted */
+static unsigned long mtext_len, mtext_alloc;
+
+#define FDSTORE_MAX 64 /* fds kept per service */
+static int notifyfd = -1; /* datagram socket services send notifications to */
+
+#define IDLE_TICK 1000 /* interval (ms) to check lazy services for activity */
+static int idle_watch; /* lazy services with an idle timeout are running */
+static unsigned long idle_checked;
+static struct pollfd *pollv; /* control fifo and fds of waiting lazy services */
+static int *pollsid;
+static int poll_alloc;
+
 static void wout(const char *s) {
   unsigned long len = str_len(s);
   if (write(1, s, len) != len) {
@@ -54,9 +238,40 @@ static void werr(const char *s) {
     fprintf(stderr, "neoinit: write err failed!\n");
   }
 }
+#define REPLY_TIMEOUT 1000 /* ms a reply may wait for a full fifo to drain */
+static unsigned long reply_until; /* ms deadline of the reply being written, 0 if not yet waited */
+static int reply_dropped;         /* the deadline passed, the rest of the reply is not written */
+
+/* start a new reply, called before each request and main loop iteration */
+static void reply_begin() {
+  reply_until = 0;
+  reply_dropped = 0;
+}
+
+/* write all of s, wait REPLY_TIMEOUT at most per reply for a full fifo to
+ * drain, then drop the rest of the reply */
 static void write_checked(int fd, const char *s, unsigned long len) {
-  if (write(fd, s, len) != len) {
-    werr("neoinit: write failed!\n");
+  while (len && !reply_dropped) {
+    long n = write(fd, s, len);
+    if (n < 0 && errno == EAGAIN) {
+      struct pollfd p = {fd, POLLOUT, 0};
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      unsigned long now = ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+      if (!reply_until) {
+        reply_until = now + REPLY_TIMEOUT;
+      }
+      if (now < reply_until && poll(&p, 1, reply_until - now) > 0) {
+        continue;
+      }
+      reply_dropped = 1;
+    }
+    if (n <= 0) {
+      werr("neoinit: write failed!\n");
+      return;
+    }
+    s += n;
+    len -= n;
   }
 }
 #ifdef DEBUG
@@ -72,10 +287,41 @@ extern char **environ;
 extern int openreadclose(char *fn, char **buf, unsigned long *len);
 extern char **split(char *buf, int sep, unsigned long *len, int plus, int ofs);
 
+/* the processes, clock and files neoinit works with, test/sim.c replaces
+ * them with a simulation on a virtual clock */
+typedef struct {
+  pid_t (*fork)(int sid, int pause); /* the child of a paused start sleeps 0.5s */
+  pid_t (*wait4)(pid_t pid, int *status, int options, struct rusage *ru);
+  int (*kill)(pid_t pid, int sig);
+  int (*openreadclose)(char *fn, char **buf, unsigned long *len);
+  int (*clock_gettime)(clockid_t clk, struct timespec *ts);
+  time_t (*time)(time_t *t);
+} sysops_t;
+
+static pid_t sys_fork(int sid, int pause) {
+  return fork();
+}
+
+static sysops_t sys = {sys_fork, wait4, kill, openreadclose, clock_gettime, time};
+
+/* FNV-1a string hash */
+unsigned int strhash(const char *s) {
+  unsigned int h = 2166136261u;
+  while (*s) {
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  }
+  return h;
+}
+
 /* return index of service or -1 if not found */
 int findservice(char *service) {
-  for (int si = 0; si <= sv_max; ++si) {
-    if (!strcmp(svlist[si].name, service)) {
+  if (!sv_slots) {
+    return -1;
+  }
+  unsigned int h = strhash(service);
+  for (unsigned int i = h & (sv_slots - 1); sv_index[i]; i = (i + 1) & (sv_slots - 1)) {
+    int si = sv_index[i] - 1;
+    if (sv.hash[si] == h && !strcmp(svname(si), service)) {
       return si;
     }
   }
@@ -85,49 +331,328 @@ int findservice(char *service) {
 /* lookup service index by PID */
 int findbypid(pid_t pid) {
   for (int si = 0; si <= sv_max; ++si) {
-    if (svlist[si].pid == pid) {
+    if (sv.pid[si] == pid) {
       return si;
     }
   }
   return -1;
 }
 
+/* change to the directory of a service, instances use that of their template,
+ * jobs have none and run in / */
+int svchdir(int sid) {
+  if (sv.flags[sid] & SV_JOB) {
+    return chdir("/");
+  }
+  if (sv.flags[sid] & SV_INSTANCE) {
+    sid = sv.cold[sid].sid_tmpl;
+  }
+  return chdir(NEOROOT) || chdir(svname(sid));
+}
+
 /* clear circular dependency detection flags */
 void circsweep() {
   for (int si = 0; si <= sv_max; ++si) {
-    svlist[si].circular = 0;
+    sv.flags[si] &= ~SV_CIRCULAR;
+  }
+}
+
+/* grow a table array to n elements of size, return nonzero on error */
+int grow(void *array, unsigned long n, unsigned long size) {
+  void *ext = realloc(*(void **)array, n * size);
+  if (!ext) {
+    return -1;
   }
+  *(void **)array = ext;
+  return 0;
 }
 
-/* add service data structure, return index or -1 */
-int addsv(sv_t *sv) {
+/* add service to the table, return index or -1 */
+int addsv(char *name, int flags, sv_t *cold) {
+  unsigned long len = str_len(name) + 1;
   if (sv_max + 1 >= sv_alloc) {
-    sv_t *svlist_ext = 0;
-    sv_alloc += 8;
-    if ((svlist_ext = (sv_t *)realloc(svlist, sv_alloc * sizeof(sv_t))) == 0) {
+    int alloc = sv_alloc ? sv_alloc * 2 : 16;
+    if (grow(&sv.pid, alloc, sizeof(*sv.pid)) || grow(&sv.state, alloc, sizeof(*sv.state)) ||
+        grow(&sv.flags, alloc, sizeof(*sv.flags)) || grow(&sv.hash, alloc, sizeof(*sv.hash)) ||
+        grow(&sv.name, alloc, sizeof(*sv.name)) || grow(&sv.cold, alloc, sizeof(*sv.cold))) {
+      return -1;
+    }
+    sv_alloc = alloc;
+  }
+  if ((sv_max + 2) * 2 > sv_slots) {
+    unsigned int slots = sv_slots ? sv_slots * 2 : 32;
+    int *index = (int *)calloc(slots, sizeof(int));
+    if (!index) {
+      return -1;
+    }
+    for (int si = 0; si <= sv_max; ++si) {
+      unsigned int i = sv.hash[si] & (slots - 1);
+      while (index[i]) {
+        i = (i + 1) & (slots - 1);
+      }
+      index[i] = si + 1;
+    }
+    free(sv_index);
+    sv_index = index;
+    sv_slots = slots;
+  }
+  if (names_len + len > names_alloc) {
+    unsigned long alloc = names_alloc ? names_alloc * 2 : 1024;
+    while (names_len + len > alloc) {
+      alloc *= 2;
+    }
+    if (grow(&names, alloc, 1)) {
       return -1;
     }
-    svlist = svlist_ext;
+    names_alloc = alloc;
+  }
+  int sid = ++sv_max;
+  memcpy(names + names_len, name, len);
+  sv.name[sid] = names_len;
+  names_len += len;
+  sv.hash[sid] = strhash(name);
+  sv.pid[sid] = 0;
+  sv.state[sid] = SID_INIT;
+  sv.flags[sid] = flags;
+  sv.cold[sid] = *cold;
+  unsigned int i = sv.hash[sid] & (sv_slots - 1);
+  while (sv_index[i]) {
+    i = (i + 1) & (sv_slots - 1);
+  }
+  sv_index[i] = sid + 1;
+  // dbg("[%d:%s] created\n", sid, svname(sid));
+  return sid;
+}
+
+/* put a new service into the slot of a finished one, return sid or -1 */
+int reusesv(int sid, char *name, int flags, sv_t *cold) {
+  unsigned long len = str_len(name) + 1;
+  unsigned int mask = sv_slots - 1;
+  unsigned long at = sv.name[sid];
+  if (len > str_len(svname(sid)) + 1) {
+    if (names_len + len > names_alloc) {
+      unsigned long alloc = names_alloc * 2;
+      while (names_len + len > alloc) {
+        alloc *= 2;
+      }
+      if (grow(&names, alloc, 1)) {
+        return -1;
+      }
+      names_alloc = alloc;
+    }
+    at = names_len;
+    names_len += len;
+  }
+  /* remove the old name from the index, moving back the entries after it */
+  unsigned int i = sv.hash[sid] & mask;
+  while (sv_index[i] != sid + 1) {
+    i = (i + 1) & mask;
+  }
+  for (unsigned int j = (i + 1) & mask; sv_index[j]; j = (j + 1) & mask) {
+    unsigned int home = sv.hash[sv_index[j] - 1] & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      sv_index[i] = sv_index[j];
+      i = j;
+    }
+  }
+  sv_index[i] = 0;
+  free(sv.cold[sid].deps.v);
+  free(sv.cold[sid].rdeps.v);
+  free(sv.cold[sid].job);
+  if (sv.cold[sid].pidfd >= 0) {
+    close(sv.cold[sid].pidfd);
   }
-  memmove(&svlist[++sv_max], sv, sizeof(sv_t));
-  // dbg("[%d:%s] created\n", sv_max, svlist[sv_max].name);
-  return sv_max;
+  memcpy(names + at, name, len);
+  sv.name[sid] = at;
+  sv.hash[sid] = strhash(name);
+  sv.pid[sid] = 0;
+  sv.state[sid] = SID_INIT;
+  sv.flags[sid] = flags;
+  sv.cold[sid] = *cold;
+  i = sv.hash[sid] & mask;
+  while (sv_index[i]) {
+    i = (i + 1) & mask;
+  }
+  sv_index[i] = sid + 1;
+  return sid;
 }
 
 int loadservice(char *service);
 
 /* create a service defined in subfolder */
-int loadsubservice(sv_t *sv, char *subservice) {
-  char *service = alloca(str_len(sv->name) + str_len(subservice) + 2);
-  strcpy(service, sv->name);
-  strcat(service, "/");
-  strcat(service, subservice);
-  return loadservice(service);
+int loadsubservice(char *service, char *subservice) {
+  char *subpath = alloca(str_len(service) + str_len(subservice) + 2);
+  strcpy(subpath, service);
+  strcat(subpath, "/");
+  strcat(subpath, subservice);
+  return loadservice(subpath);
+}
+
+/* create and bind a socket for a listen entry: /path or @abstract for a
+ * unix socket, fifo:/path for a fifo, else [tcp:|udp:][address:]port.
+ * Return the fd or -1 */
+int listenfd(char *addr) {
+  union {
+    struct sockaddr sa;
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+  } sa;
+  socklen_t salen;
+  int type = SOCK_STREAM;
+  int one = 1;
+  int fd;
+  memset(&sa, 0, sizeof(sa));
+  if (str_start(addr, "fifo:")) {
+    addr += 5;
+    if (mkfifo(addr, 0600) && errno != EEXIST) {
+      return -1;
+    }
+    return open(addr, O_RDWR | O_CLOEXEC);
+  }
+  if (*addr == '/' || *addr == '@') {
+    unsigned long len = str_len(addr);
+    if (len >= sizeof(sa.un.sun_path)) {
+      return -1;
+    }
+    sa.un.sun_family = AF_UNIX;
+    memcpy(sa.un.sun_path, addr, len);
+    salen = offsetof(struct sockaddr_un, sun_path) + len + (*addr == '/');
+    if (*addr == '@') {
+      sa.un.sun_path[0] = 0;
+    } else {
+      unlink(addr);
+    }
+  } else {
+    char *port;
+    if (str_start(addr, "udp:")) {
+      type = SOCK_DGRAM;
+      addr += 4;
+    } else if (str_start(addr, "tcp:")) {
+      addr += 4;
+    }
+    port = strrchr(addr, ':');
+    if (port) {
+      *port++ = 0;
+    } else {
+      port = addr;
+      addr = "0.0.0.0";
+    }
+    if (*addr == '[' && addr[str_len(addr) - 1] == ']') {
+      addr[str_len(addr) - 1] = 0;
+      sa.in6.sin6_family = AF_INET6;
+      sa.in6.sin6_port = htons(atoi(port));
+      salen = sizeof(sa.in6);
+      if (inet_pton(AF_INET6, addr + 1, &sa.in6.sin6_addr) != 1) {
+        return -1;
+      }
+    } else {
+      sa.in.sin_family = AF_INET;
+      sa.in.sin_port = htons(atoi(port));
+      salen = sizeof(sa.in);
+      if (inet_pton(AF_INET, addr, &sa.in.sin_addr) != 1) {
+        return -1;
+      }
+    }
+  }
+  if ((fd = socket(sa.sa.sa_family, type | SOCK_CLOEXEC, 0)) < 0) {
+    return -1;
+  }
+  if (sa.sa.sa_family != AF_UNIX) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  }
+  if (bind(fd, &sa.sa, salen) || (type == SOCK_STREAM && listen(fd, SOMAXCONN))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* parse a CPU list like 0-3,6 into set */
+void cpulist(char *x, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*x) {
+    unsigned char c = 0;
+    int from = 0, to = 0;
+    while (*x && (c = *x - '0') >= 10) {
+      ++x;
+    }
+    if (!*x) {
+      break;
+    }
+    while ((c = *x - '0') < 10) {
+      from = from * 10 + c;
+      ++x;
+    }
+    to = from;
+    if (*x == '-') {
+      for (to = 0, ++x; (c = *x - '0') < 10; ++x) {
+        to = to * 10 + c;
+      }
+    }
+    for (int i = from; i <= to && i < CPU_SETSIZE; ++i) {
+      CPU_SET(i, set);
+    }
+  }
+}
+
+/* read the CPU list of the affinity file of the current service,
+ * all CPUs neoinit may run on if it is empty */
+void loadaffinity(sv_t *cold) {
+  unsigned long len = 0;
+  char *data = 0;
+  cpu_set_t set;
+  if (sys.openreadclose("affinity", &data, &len)) {
+    return;
+  }
+  cpulist(data, &set);
+  free(data);
+  if (!CPU_COUNT(&set) && sched_getaffinity(0, sizeof(set), &set)) {
+    return;
+  }
+  if ((cold->cpus = (int *)malloc(CPU_COUNT(&set) * sizeof(int)))) {
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &set)) {
+        cold->cpus[cold->ncpus++] = i;
+      }
+    }
+  }
+}
+
+/* bind the sockets listed in the listen file of the current service */
+void loadlisten(char *service, sv_t *cold) {
+  unsigned long len = 0;
+  char *data = 0;
+  char **addrv;
+  if (sys.openreadclose("listen", &data, &len)) {
+    return;
+  }
+  len = 0;
+  addrv = split(data, '\n', &len, 0, 0);
+  if (addrv && (cold->lfd = (int *)malloc(len * sizeof(int)))) {
+    for (int i = 0; i < len; ++i) {
+      if (addrv[i][0] == 0 || addrv[i][0] == '#') {
+        continue;
+      }
+      dbg("[%s] listen %s\n", service, addrv[i]);
+      int fd = listenfd(addrv[i]);
+      if (fd < 0) {
+        werr("neoinit: could not listen on ");
+        werr(addrv[i]);
+        werr("\n");
+        continue;
+      }
+      cold->lfd[cold->nlfd++] = fd;
+    }
+  }
+  free(addrv);
+  free(data);
 }
 
 /* load service, return index or -1 if failed */
 int loadservice(char *service) {
-  sv_t sv;
+  sv_t cold;
+  int flags = 0;
   if (*service == 0 || str_len(service) > PATH_MAX) {
     return -1;
   }
@@ -135,43 +660,130 @@ int loadservice(char *service) {
   if (sid >= 0) {
     return sid;
   }
+  char *at = strchr(service, '@');
+  if ((chdir(NEOROOT) || chdir(service)) && at && at[1] && !strchr(at, '/')) {
+    /* instance of a template, shares its parsed definition */
+    char *tmpl = (char *)alloca(at - service + 2);
+    memcpy(tmpl, service, at - service + 1);
+    tmpl[at - service + 1] = 0;
+    int sid_tmpl = loadservice(tmpl);
+    if (sid_tmpl < 0 || !(sv.flags[sid_tmpl] & SV_TEMPLATE)) {
+      return -1;
+    }
+    cold = sv.cold[sid_tmpl];
+    memset(&cold.deps, 0, sizeof(edges_t));
+    memset(&cold.rdeps, 0, sizeof(edges_t));
+    cold.store = 0;
+    cold.nstore = 0;
+    cold.sid_tmpl = sid_tmpl;
+    flags = sv.flags[sid_tmpl] & (SV_RESPAWN | SV_LAZY | SV_NOTIFY | SV_STANDBY);
+    return addsv(service, flags | SV_INSTANCE, &cold);
+  }
   if (chdir(NEOROOT) || chdir(service)) {
     return -1;
   }
-  if (!(sv.name = strdup(service))) {
-    return -1;
+  memset(&cold, 0, sizeof(sv_t));
+  cold.sid_father = -1;
+  if (at && !at[1]) {
+    flags |= SV_TEMPLATE;
+    cold.instances = 1;
   }
-  sv.pid = 0;
-  sv.circular = 0;
-  sv.changed_at = 0;
-  sv.state = SID_INIT;
   int fd = open("respawn", O_RDONLY | O_CLOEXEC);
   if (fd >= 0) {
     close(fd);
-    sv.respawn = 1;
-  } else {
-    sv.respawn = 0;
+    flags |= SV_RESPAWN;
+  }
+  if ((fd = open("lazy", O_RDONLY | O_CLOEXEC)) >= 0) {
+    close(fd);
+    flags |= SV_LAZY;
+  }
+  if ((fd = open("notify", O_RDONLY | O_CLOEXEC)) >= 0) {
+    close(fd);
+    flags |= SV_NOTIFY;
   }
-  sv.__stdin = 0;
-  sv.__stdout = 1;
+  if ((fd = open("standby", O_RDONLY | O_CLOEXEC)) >= 0) {
+    close(fd);
+    flags |= SV_STANDBY;
+  }
+  cold.pidfd = -1;
+  cold.pidfd_standby = -1;
+  cold.exitcode = -1;
+  cold.__stdin = 0;
+  cold.__stdout = 1;
 
-  sv.sid_log = loadsubservice(&sv, "log");
-  if (sv.sid_log >= 0) {
+  cold.sid_log = loadsubservice(service, "log");
+  if (cold.sid_log >= 0) {
     int pipefd[2];
     if (pipe(pipefd) ||
         fcntl(pipefd[0], F_SETFD, FD_CLOEXEC) ||
         fcntl(pipefd[1], F_SETFD, FD_CLOEXEC)) {
-      free(sv.name);
       return -1;
     }
-    svlist[sv.sid_log].__stdin = pipefd[0];
-    sv.__stdout = pipefd[1];
+    sv.cold[cold.sid_log].__stdin = pipefd[0];
+    cold.__stdout = pipefd[1];
   }
-  sid = addsv(&sv);
-  if (sid < 0) {
-    free(sv.name);
+  if (!chdir(NEOROOT) && !chdir(service)) {
+    unsigned long len = 0;
+    char *data = 0;
+    loadlisten(service, &cold);
+    if (!sys.openreadclose("idle", &data, &len)) {
+      cold.idle = atoi(data) * 1000UL;
+      free(data);
+    }
+    if ((flags & SV_TEMPLATE) && !sys.openreadclose("instances", &data, &len)) {
+      cold.instances = atoi(data);
+      free(data);
+    }
+    if (flags & SV_TEMPLATE) {
+      loadaffinity(&cold);
+    }
   }
-  return sid;
+  return addsv(service, flags, &cold);
+}
+
+/* append sid to edge list, return nonzero on error */
+int edge_push(edges_t *e, int sid) {
+  if (e->n >= e->alloc) {
+    int alloc = e->alloc ? e->alloc * 2 : 4;
+    if (grow(&e->v, alloc, sizeof(int))) {
+      return -1;
+    }
+    e->alloc = alloc;
+  }
+  e->v[e->n++] = sid;
+  return 0;
+}
+
+/* remove sid from edge list */
+void edge_drop(edges_t *e, int sid) {
+  for (int i = 0; i < e->n; ++i) {
+    if (e->v[i] == sid) {
+      memmove(e->v + i, e->v + i + 1, (--e->n - i) * sizeof(int));
+      return;
+    }
+  }
+}
+
+/* record that sid depends on sid_dep */
+void adddep(int sid, int sid_dep) {
+  edges_t *deps = &sv.cold[sid].deps;
+  for (int i = 0; i < deps->n; ++i) {
+    if (deps->v[i] == sid_dep) {
+      return;
+    }
+  }
+  if (!edge_push(deps, sid_dep) && edge_push(&sv.cold[sid_dep].rdeps, sid)) {
+    deps->n--;
+  }
+}
+
+/* forget the dependencies of sid, before they are read again */
+void cleardeps(int sid) {
+  edges_t *deps = &sv.cold[sid].deps;
+  for (int i = 0; i < deps->n; ++i) {
+    edge_drop(&sv.cold[deps->v[i]].rdeps, sid);
+  }
+  deps->n = 0;
 }
 
 /* usage: isup(findservice("sshd")), returns nonzero if process was already started */
@@ -179,7 +791,7 @@ int isup(int sid) {
   if (sid < 0) {
     return 0;
   }
-  return (svlist[sid].state != SID_INIT);
+  return (sv.state[sid] != SID_INIT);
 }
 
 /* usage: isrunning(findservice("sshd")), returns nonzero if process is running */
@@ -187,103 +799,722 @@ int isrunning(int sid) {
   if (sid < 0) {
     return 0;
   }
-  return (svlist[sid].pid > 1);
+  return (sv.pid[sid] > 1);
 }
 
-int startservice(int sid, int pause, int sid_father);
-int startnodep(int sid, int pause, int setup);
+unsigned long msnow();
 
-void handlekilled(pid_t killed, int status) {
-  if (!killed) {
-    return;
+/* microseconds of monotonic time, wraps around */
+unsigned long usnow() {
+  struct timespec ts;
+  sys.clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* record an event in the trace ring, overwriting the oldest */
+void trace(int type, int sid, int a, int b) {
+  trace_t *t = &trace_ring[traced++ & (TRACE_EVENTS - 1)];
+  t->us = usnow();
+  t->type = type;
+  t->sid = sid;
+  t->a = a;
+  t->b = b;
+#ifdef USDT
+  DTRACE_PROBE4(neoinit, event, type, sid, a, b);
+#endif
+}
+
+/* dump the trace ring to the control fifo, one event per line, oldest first:
+ * us type sid:name (neoinit if none) and the event data */
+void trace_dump() {
+  static const char *type[] = {"state", "fork", "reap", "ctl"};
+  char line[FMT_STATE + 4 * FMT_ULONG + 16];
+  write_checked(outfd, "1:", 2);
+  for (unsigned long i = traced > TRACE_EVENTS ? traced - TRACE_EVENTS : 0; i < traced; ++i) {
+    trace_t *t = &trace_ring[i & (TRACE_EVENTS - 1)];
+    unsigned long len = fmt_ulong(line, t->us);
+    line[len++] = ' ';
+    len += fmt_str(line + len, type[t->type]);
+    line[len++] = ' ';
+    if (t->sid >= 0) {
+      len += fmt_ulong(line + len, t->sid);
+      line[len++] = ':';
+      write_checked(outfd, line, len);
+      write_checked(outfd, svname(t->sid), str_len(svname(t->sid)));
+    } else {
+      write_checked(outfd, line, len);
+      write_checked(outfd, "neoinit", 7);
+    }
+    len = 0;
+    line[len++] = ' ';
+    if (t->type == TR_STATE) {
+      len += fmt_state(line + len, t->a);
+    } else if (t->type == TR_CTL) {
+      line[len++] = t->a;
+    } else {
+      len += fmt_long(line + len, t->a);
+    }
+    if (t->type == TR_REAP || t->type == TR_CTL) {
+      line[len++] = ' ';
+      len += fmt_long(line + len, t->b);
+    }
+    line[len++] = 0;
+    write_checked(outfd, line, len);
   }
-  int sid = findbypid(killed);
-  dbg("[neoinit] pid %d exited: sid %d %s\n", killed, sid, sid >= 0 ? svlist[sid].name : "");
-  if (sid < 0) {
-    return;
+  write_checked(outfd, "\0", 1);
+}
+
+/* set the state of a service and trace it */
+void state_set(int sid, int state) {
+  sv.state[sid] = state;
+  trace(TR_STATE, sid, state, 0);
+}
+
+/* count a latency of us microseconds */
+void hist_add(hist_t *h, unsigned long us) {
+  int i = 0;
+  for (unsigned long bound = 10; i < HIST_BUCKETS - 1 && us > bound; bound *= 10) {
+    ++i;
   }
-  if (svlist[sid].state != SID_STOPPED) { // has been stopped
-    if (svlist[sid].state == SID_SETUP) { // was setup
-      if (WIFEXITED(status) && WEXITSTATUS(status)) {
-        dbg("[%d:%s] CANCELED %d\n", sid, svlist[sid].name, WEXITSTATUS(status));
-        svlist[sid].state = SID_CANCELED;
-      } else {
-        dbg("[%d:%s] INIT\n", sid, svlist[sid].name);
-        svlist[sid].state = SID_INIT;
-      }
-    } else { // was active
-      if (WIFEXITED(status) && WEXITSTATUS(status)) {
-        dbg("[%d:%s] FAILED %d\n", sid, svlist[sid].name, WEXITSTATUS(status));
-        svlist[sid].state = SID_FAILED;
-      } else {
-        dbg("[%d:%s] FINISHED\n", sid, svlist[sid].name);
-        svlist[sid].state = SID_FINISHED;
-      }
+  h->bucket[i]++;
+  h->count++;
+  h->sum_us += us;
+}
+
+/* append len bytes of s to the metrics text */
+void mput(const char *s, unsigned long len) {
+  if (mtext_len + len > mtext_alloc) {
+    unsigned long alloc = mtext_alloc ? mtext_alloc * 2 : 4096;
+    while (mtext_len + len > alloc) {
+      alloc *= 2;
     }
+    if (grow(&mtext, alloc, 1)) {
+      return;
+    }
+    mtext_alloc = alloc;
   }
-  if (svlist[sid].state == SID_FINISHED && !chdir(NEOROOT) && !chdir(svlist[sid].name)) {
-    unsigned long len = 0;
-    char *pidfile = 0;
-    if (!openreadclose("pidfile", &pidfile, &len)) {
-      for (char *s = pidfile; *s; s++) {
-        if (*s == '\n') {
-          *s = 0;
-          break;
-        }
-      }
-      int fd = open(pidfile, O_RDONLY | O_CLOEXEC);
-      free(pidfile);
-      if (fd >= 0) {
-        char pidbuf[8];
-        len = read(fd, pidbuf, sizeof(pidbuf) - 1);
-        close(fd);
-        if (len > 0) {
-          pidbuf[len] = 0;
-          char *x = pidbuf;
-          unsigned char c = 0;
-          pid_t pid = 0;
-          while ((c = *x++ - '0') < 10) {
-            pid = pid * 10 + c;
-          }
-          if (pid > 0 && !kill(pid, 0)) {
-            dbg("[%d:%s] pidfile %d\n", sid, svlist[sid].name, pid);
-            svlist[sid].pid = pid;
-            return;
-          }
-        }
-      }
+  memcpy(mtext + mtext_len, s, len);
+  mtext_len += len;
+}
+
+void mputs(const char *s) {
+  mput(s, str_len(s));
+}
+
+void mputul(unsigned long n) {
+  char tmp[FMT_ULONG];
+  mput(tmp, fmt_ulong(tmp, n));
+}
+
+void mputl(long n) {
+  char tmp[FMT_ULONG + 1];
+  mput(tmp, fmt_long(tmp, n));
+}
+
+/* append microseconds as seconds */
+void mputsec(unsigned long us) {
+  char tmp[FMT_ULONG];
+  unsigned long len = fmt_ulong(tmp, 1000000 + us % 1000000);
+  mputul(us / 1000000);
+  mputs(".");
+  mput(tmp + 1, len - 1);
+}
+
+/* append the label value of a service name, escaped */
+void mputname(int sid) {
+  char *name = svname(sid);
+  mputs("{service=\"");
+  for (char *x = name; *x; ++x) {
+    if (*x == '"' || *x == '\\' || *x == '\n') {
+      mput(name, x - name);
+      mputs(*x == '\n' ? "\\n" : *x == '"' ? "\\\"" : "\\\\");
+      name = x + 1;
     }
   }
-  time_t sid_started_at = svlist[sid].changed_at;
-  svlist[sid].changed_at = time(0); /* set stop time */
-  dbg("[%d:%s] pid down\n", sid, svlist[sid].name);
-  svlist[sid].pid = PID_DOWN;
+  mputs(name);
+  mputs("\"}");
+}
 
-  if (svlist[sid].state == SID_INIT) {
-    startnodep(sid, 0, 0);
-  } else if (svlist[sid].state != SID_STOPPED && svlist[sid].state != SID_CANCELED &&
-             svlist[sid].respawn) {
-    dbg("[%d:%s] respawn\n", sid, svlist[sid].name);
-    dbg("[%d:%s] INIT\n", sid, svlist[sid].name);
-    svlist[sid].state = SID_INIT;
-    circsweep();
-    startservice(sid, time(0) - sid_started_at < 1, svlist[sid].sid_father);
+void mputhelp(const char *name, const char *type, const char *help) {
+  mputs("# HELP ");
+  mputs(name);
+  mputs(" ");
+  mputs(help);
+  mputs("\n# TYPE ");
+  mputs(name);
+  mputs(" ");
+  mputs(type);
+  mputs("\n");
+}
+
+/* append histogram h as name with the label (or 0) */
+void mputhist(const char *name, const char *label, hist_t *h) {
+  static const char *le[HIST_BUCKETS] = {"0.00001", "0.0001", "0.001", "0.01",
+                                         "0.1",     "1",      "10",    "+Inf"};
+  unsigned long sum = 0;
+  for (int i = 0; i < HIST_BUCKETS; ++i) {
+    sum += h->bucket[i];
+    mputs(name);
+    mputs("_bucket{");
+    if (label) {
+      mputs(label);
+      mputs(",");
+    }
+    mputs("le=\"");
+    mputs(le[i]);
+    mputs("\"} ");
+    mputul(sum);
+    mputs("\n");
+  }
+  for (int i = 0; i < 2; ++i) {
+    mputs(name);
+    mputs(i ? "_count" : "_sum");
+    if (label) {
+      mputs("{");
+      mputs(label);
+      mputs("}");
+    }
+    mputs(" ");
+    if (i) {
+      mputul(h->count);
+    } else {
+      mputsec(h->sum_us);
+    }
+    mputs("\n");
   }
 }
 
-/* called from inside the service directory, return the PID or 0 on error */
-pid_t forkandexec(int sid, int pause, int setup) {
-  int count = 0;
-  pid_t pid = 0;
-  int sync = 0;
-  unsigned long len = 0;
-  char *argdata = 0;
-  char **argv = 0;
+/* format the metrics in Prometheus text format into mtext */
+void metrics_format() {
+  static const char *counter[] = {"neoinit_spawns_total", "processes spawned",
+                                  "neoinit_respawns_total", "automatic restarts",
+                                  "neoinit_failures_total", "exits with an error or by a signal"};
+  mtext_len = 0;
+  for (int c = 0; c < 3; ++c) {
+    mputhelp(counter[2 * c], "counter", counter[2 * c + 1]);
+    for (int sid = 0; sid <= sv_max; ++sid) {
+      sv_t *cold = &sv.cold[sid];
+      mputs(counter[2 * c]);
+      mputname(sid);
+      mputs(" ");
+      mputul(c == 0 ? cold->spawns : c == 1 ? cold->respawns : cold->failures);
+      mputs("\n");
+    }
+  }
+  mputhelp("neoinit_respawn_seconds", "histogram", "time from the exit of a service to its respawn");
+  mputhist("neoinit_respawn_seconds", 0, &respawn_hist);
+  mputhelp("neoinit_control_seconds", "histogram", "time to handle a control request");
+  for (int op = 0; op < 128; ++op) {
+    if (ctl_hist[op].count) {
+      char label[] = "op=\"x\"";
+      label[4] = op;
+      mputhist("neoinit_control_seconds", label, &ctl_hist[op]);
+    }
+  }
+  mputhelp("neoinit_control_queue_bytes", "gauge", "bytes left in the control fifo after a request");
+  mputs("neoinit_control_queue_bytes ");
+  mputul(ctl_queued);
+  mputs("\n");
+  mputhelp("neoinit_control_queue_bytes_max", "gauge", "most bytes left in the control fifo");
+  mputs("neoinit_control_queue_bytes_max ");
+  mputul(ctl_queued_max);
+  mputs("\n");
+  mputhelp("neoinit_loop_seconds", "histogram", "main loop iterations, without waiting for events");
+  mputhist("neoinit_loop_seconds", 0, &loop_hist);
+}
+
+/* write the metrics to the control fifo, lines end in 0 */
+void metrics_dump() {
+  metrics_format();
+  write_checked(outfd, "1:", 2);
+  for (unsigned long i = 0; i < mtext_len; ++i) {
+    if (mtext[i] == '\n') {
+      mtext[i] = 0;
+    }
+  }
+  write_checked(outfd, mtext, mtext_len);
+  write_checked(outfd, "\0", 1);
+}
+
+/* replace the metrics file if anything was counted since it was written */
+void metrics_save() {
+  unsigned long now = msnow();
+  if (!metrics_path || !metrics_dirty || now - metrics_written < METRICS_INTERVAL) {
+    return;
+  }
+  char *tmp = (char *)alloca(str_len(metrics_path) + 5);
+  strcpy(tmp, metrics_path);
+  strcat(tmp, ".tmp");
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  metrics_format();
+  if (write(fd, mtext, mtext_len) != mtext_len || close(fd) || rename(tmp, metrics_path)) {
+    unlink(tmp);
+  }
+  metrics_dirty = 0;
+  metrics_written = now;
+}
+
+int startservice(int sid, int pause, int sid_father);
+int startnodep(int sid, int pause, int setup);
+int scale(int sid, int pause);
+void restart_end(int sid, int ok);
+void standby_check(int sid, int pause);
+
+/* read the children of neoinit, return their number or -1 */
+int children(pid_t **list) {
+  static char *buf;
+  static unsigned long alloc;
+  static pid_t *pids;
+  static int pids_alloc;
+  char fn[48] = "/proc/self/task/";
+  unsigned long len = 0;
+  long r;
+  int n = 0;
+  fn[16 + fmt_ulong(fn + 16, getpid())] = 0;
+  strcat(fn, "/children");
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  do {
+    if (len == alloc) {
+      char *b = (char *)realloc(buf, (alloc = alloc * 2 + 512) + 1);
+      if (!b) {
+        close(fd);
+        return -1;
+      }
+      buf = b;
+    }
+    r = read(fd, buf + len, alloc - len);
+    len += r > 0 ? r : 0;
+  } while (r > 0);
+  close(fd);
+  buf[len] = 0;
+  for (char *x = buf; *x;) {
+    unsigned char c = 0;
+    pid_t pid = 0;
+    while ((c = *x - '0') < 10) {
+      pid = pid * 10 + c;
+      ++x;
+    }
+    if (*x) {
+      ++x;
+    }
+    if (!pid) {
+      continue;
+    }
+    if (n == pids_alloc) {
+      if (grow(&pids, pids_alloc * 2 + 16, sizeof(pid_t))) {
+        return -1;
+      }
+      pids_alloc = pids_alloc * 2 + 16;
+    }
+    pids[n++] = pid;
+  }
+  *list = pids;
+  return n;
+}
+
+/* find the descendant a finished service left behind when its process killed
+ * exited: a child in the session or process group of killed, else the only
+ * child that was reparented to neoinit just now and left for a session of
+ * its own, not that of neoinit or another service, if killed is the only
+ * process exited. Return 0 if there is none. With killed 0 only note the
+ * children not belonging to a service */
+pid_t adopt(pid_t killed) {
+  siginfo_t info;
+  pid_t *list = 0;
+  pid_t found = 0, guess = 0;
+  int nguess = 0;
+  int n = children(&list);
+  if (n < 0) {
+    return 0;
+  }
+  info.si_pid = 0;
+  if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT)) {
+    info.si_pid = 0;
+  }
+  if (!killed && info.si_pid) {
+    return 0; /* children of an exited process may be in the list, adopt them later */
+  }
+  for (int i = 0; i < n && killed; ++i) {
+    if (findbypid(list[i]) >= 0) {
+      continue;
+    }
+    pid_t sess = getsid(list[i]);
+    if (sess == killed || getpgid(list[i]) == killed) {
+      found = list[i];
+      break;
+    }
+    int j = 0;
+    while (j < norphans && orphans[j] != list[i]) {
+      ++j;
+    }
+    if (j == norphans && sess != getsid(0) && findbypid(sess) < 0) {
+      guess = list[i];
+      ++nguess;
+    }
+  }
+  /* a new child could be left by any process exited with killed, it is
+   * only taken when there is no doubt */
+  if (!found && nguess == 1 && nreaped <= 1 && !info.si_pid) {
+    found = guess;
+  }
+  /* remember the others, they are not attributed to a later exit */
+  norphans = 0;
+  for (int i = 0; i < n; ++i) {
+    if (list[i] != found && findbypid(list[i]) < 0) {
+      if (norphans == orphans_alloc) {
+        if (grow(&orphans, orphans_alloc * 2 + 16, sizeof(pid_t))) {
+          break;
+        }
+        orphans_alloc = orphans_alloc * 2 + 16;
+      }
+      orphans[norphans++] = list[i];
+    }
+  }
+  return found;
+}
+
+/* close the stored fds of a service with name, all if name is 0 */
+void fdstore_drop(int sid, char *name) {
+  sv_t *cold = &sv.cold[sid];
+  int n = 0;
+  for (int i = 0; i < cold->nstore; ++i) {
+    if (!name || !strcmp(cold->store[i].name, name)) {
+      dbg("[%d:%s] fdstore remove %s\n", sid, svname(sid), cold->store[i].name);
+      close(cold->store[i].fd);
+      free(cold->store[i].name);
+    } else {
+      cold->store[n++] = cold->store[i];
+    }
+  }
+  cold->nstore = n;
+}
+
+void handlekilled(pid_t killed, int status) {
+  struct rusage *ru = reaped;
+  reaped = 0; /* not for the children reaped while handling this one */
+  if (!killed) {
+    return;
+  }
+  int sid = findbypid(killed);
+  trace(TR_REAP, sid, killed, status);
+  dbg("[neoinit] pid %d exited: sid %d %s\n", killed, sid, sid >= 0 ? svname(sid) : "");
+  if (sid < 0) {
+    for (int si = 0; si <= sv_max; ++si) {
+      if (sv.cold[si].pid_old == killed) {
+        dbg("[%d:%s] previous instance down\n", si, svname(si));
+        sv.cold[si].pid_old = 0;
+      }
+      if (sv.cold[si].pid_standby == killed) {
+        sv_t *cold = &sv.cold[si];
+        int quick = 0;
+        dbg("[%d:%s] standby down\n", si, svname(si));
+        cold->pid_standby = 0;
+        if (cold->pidfd_standby >= 0) {
+          close(cold->pidfd_standby);
+          cold->pidfd_standby = -1;
+        }
+        if (cold->standby_ms) {
+          /* it died on its own, count it and pause like a respawn */
+          quick = msnow() - cold->standby_ms < 1000;
+          cold->standby_quick = quick ? cold->standby_quick + 1 : 0;
+          if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            cold->failures++;
+            metrics_dirty = 1;
+          }
+          if (cold->standby_quick == STANDBY_TRIES) {
+            dbg("[%d:%s] standby fails, given up\n", si, svname(si));
+          }
+        }
+        if (sv.state[si] == SID_ACTIVE) {
+          standby_check(si, quick);
+        }
+      }
+    }
+    return;
+  }
+  if (sv.cold[sid].pidfd >= 0) {
+    close(sv.cold[sid].pidfd);
+    sv.cold[sid].pidfd = -1;
+  }
+  if (ru) {
+    sv_t *cold = &sv.cold[sid];
+    cold->exitcode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    cold->utime = ru->ru_utime.tv_sec * 1000UL + ru->ru_utime.tv_usec / 1000;
+    cold->stime = ru->ru_stime.tv_sec * 1000UL + ru->ru_stime.tv_usec / 1000;
+    cold->maxrss = ru->ru_maxrss;
+  }
+  if (sid == restart_sid) {
+    /* the new instance died before it was ready */
+    int fallback = sv.cold[sid].pid_old > 1;
+    restart_end(sid, 0);
+    if (fallback) {
+      return;
+    }
+  }
+  if (sv.state[sid] != SID_STOPPED && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+    sv.cold[sid].failures++;
+    metrics_dirty = 1;
+  }
+  if (sv.state[sid] != SID_STOPPED) { // has been stopped
+    if (sv.state[sid] == SID_SETUP) { // was setup
+      if (WIFEXITED(status) && WEXITSTATUS(status)) {
+        dbg("[%d:%s] CANCELED %d\n", sid, svname(sid), WEXITSTATUS(status));
+        state_set(sid, SID_CANCELED);
+      } else {
+        dbg("[%d:%s] INIT\n", sid, svname(sid));
+        state_set(sid, SID_INIT);
+      }
+    } else { // was active
+      if (WIFEXITED(status) && WEXITSTATUS(status)) {
+        dbg("[%d:%s] FAILED %d\n", sid, svname(sid), WEXITSTATUS(status));
+        state_set(sid, SID_FAILED);
+      } else {
+        dbg("[%d:%s] FINISHED\n", sid, svname(sid));
+        state_set(sid, SID_FINISHED);
+      }
+    }
+  }
+  if (sv.state[sid] == SID_FINISHED && !(sv.flags[sid] & SV_JOB) && !svchdir(sid)) {
+    unsigned long len = 0;
+    char *pidfile = 0;
+    if (!sys.openreadclose("pidfile", &pidfile, &len)) {
+      for (char *s = pidfile; *s; s++) {
+        if (*s == '\n') {
+          *s = 0;
+          break;
+        }
+      }
+      int fd = open(pidfile, O_RDONLY | O_CLOEXEC);
+      free(pidfile);
+      if (fd >= 0) {
+        char pidbuf[8];
+        len = read(fd, pidbuf, sizeof(pidbuf) - 1);
+        close(fd);
+        if (len > 0) {
+          pidbuf[len] = 0;
+          char *x = pidbuf;
+          unsigned char c = 0;
+          pid_t pid = 0;
+          while ((c = *x++ - '0') < 10) {
+            pid = pid * 10 + c;
+          }
+          if (pid > 0 && !sys.kill(pid, 0)) {
+            dbg("[%d:%s] pidfile %d\n", sid, svname(sid), pid);
+            sv.pid[sid] = pid;
+            return;
+          }
+        }
+      }
+    }
+  }
+  if (sv.state[sid] == SID_FINISHED && WIFEXITED(status) && !(sv.flags[sid] & SV_JOB) &&
+      (subreaper || iam_init)) {
+    pid_t pid = adopt(killed);
+    if (pid > 0) {
+      dbg("[%d:%s] adopted %d\n", sid, svname(sid), pid);
+      sv.pid[sid] = pid;
+      return;
+    }
+  }
+  if (sv.cold[sid].pid_standby > 1 &&
+      (sv.state[sid] == SID_FINISHED || sv.state[sid] == SID_FAILED)) {
+    /* fail over to the standby, it is told by USR1 */
+    dbg("[%d:%s] promote standby\n", sid, svname(sid));
+    dbg("[%d:%s] ACTIVE\n", sid, svname(sid));
+    state_set(sid, SID_ACTIVE);
+    sv.pid[sid] = sv.cold[sid].pid_standby;
+    sv.cold[sid].pid_standby = 0;
+    sv.cold[sid].pidfd = sv.cold[sid].pidfd_standby;
+    sv.cold[sid].pidfd_standby = -1;
+    sv.cold[sid].changed_at = sys.time(0);
+    sv.cold[sid].started_ms = msnow();
+    sys.kill(sv.pid[sid], SIGUSR1);
+    standby_check(sid, 0);
+    return;
+  }
+  if (sv.cold[sid].pid_standby > 1 && !sys.kill(sv.cold[sid].pid_standby, SIGTERM)) {
+    sys.kill(sv.cold[sid].pid_standby, SIGCONT);
+    sv.cold[sid].standby_ms = 0;
+  }
+  if (sv.state[sid] == SID_STOPPED) {
+    fdstore_drop(sid, 0);
+  }
+  time_t sid_started_at = sv.cold[sid].changed_at;
+  sv.cold[sid].changed_at = sys.time(0); /* set stop time */
+  dbg("[%d:%s] pid down\n", sid, svname(sid));
+  sv.pid[sid] = PID_DOWN;
+
+  if ((sv.flags[sid] & SV_LAZY) && sv.cold[sid].nlfd &&
+      ((sv.flags[sid] & SV_IDLE) || sv.state[sid] == SID_FINISHED)) {
+    /* wait for the next activity again */
+    sv.flags[sid] &= ~SV_IDLE;
+    dbg("[%d:%s] WAITING\n", sid, svname(sid));
+    state_set(sid, SID_WAITING);
+    return;
+  }
+
+  if (sv.state[sid] == SID_INIT) {
+    startnodep(sid, 0, 0);
+  } else if (sv.state[sid] != SID_STOPPED && sv.state[sid] != SID_CANCELED &&
+             (sv.flags[sid] & SV_RESPAWN)) {
+    dbg("[%d:%s] respawn\n", sid, svname(sid));
+    dbg("[%d:%s] INIT\n", sid, svname(sid));
+    state_set(sid, SID_INIT);
+    sv.cold[sid].respawns++;
+    sv.cold[sid].respawn_us = usnow();
+    circsweep();
+    startservice(sid, sys.time(0) - sid_started_at < 1, sv.cold[sid].sid_father);
+  }
+}
+
+/* milliseconds of monotonic time, wraps around */
+unsigned long msnow() {
+  struct timespec ts;
+  sys.clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* called from inside the service directory, returns nonzero if neoinit has to wait for it */
+int issync(int sid) {
+  // sync on service 'boot' and depends
+  if ((sid == 0 || sv.cold[sid].sid_father == 0) && !strcmp(svname(0), "boot")) {
+    return 1;
+  }
+  int fd = open("sync", O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    close(fd);
+    return 1;
+  }
+  return 0;
+}
+
+/* return highest some avg10 pressure of cpu, io and memory in percent */
+int psi_read() {
+  static const char *res[] = {"/proc/pressure/cpu", "/proc/pressure/io", "/proc/pressure/memory"};
+  int psi = 0;
+  for (int i = 0; i < 3; ++i) {
+    char buf[128];
+    unsigned long len = sizeof(buf) - 1;
+    char *x = buf;
+    if (sys.openreadclose((char *)res[i], &x, &len) || !(x = strstr(buf, "avg10="))) {
+      continue;
+    }
+    x += 6;
+    unsigned char c = 0;
+    int p = 0;
+    while ((c = *x++ - '0') < 10) {
+      p = p * 10 + c;
+    }
+    if (p > psi) {
+      psi = p;
+    }
+  }
+  return psi;
+}
+
+/* returns nonzero if the governor allows to spawn another service now */
+int spawn_ok() {
+  if (!spawn_max) {
+    return 1;
+  }
+  unsigned long now = msnow();
+  for (int i = 0; i < nspawning; ++i) {
+    int sid = spawning[i];
+    /* services reporting readiness count until they are ready */
+    int settled = (sv.flags[sid] & SV_NOTIFY) && sv.state[sid] == SID_ACTIVE
+                      ? sv.flags[sid] & SV_READY
+                      : now - sv.cold[sid].started_ms >= spawn_settle;
+    if (!isrunning(sid) || settled ||
+        (sv.state[sid] != SID_ACTIVE && sv.state[sid] != SID_SETUP)) {
+      spawning[i--] = spawning[--nspawning];
+    }
+  }
+  if (spawn_psi && now - psi_checked >= PSI_INTERVAL) {
+    psi_checked = now;
+    if (psi_read() >= spawn_psi) {
+      spawn_limit = spawn_limit > 1 ? spawn_limit / 2 : 1;
+      dbg("[neoinit] pressure, spawn limit %d\n", spawn_limit);
+    } else if (spawn_limit < spawn_max) {
+      spawn_limit++;
+    }
+  }
+  return nspawning < spawn_limit;
+}
+
+/* defer a service start until the governor allows it, return nonzero on error */
+int spawn_defer(int sid, int setup) {
+  if (sv.flags[sid] & SV_QUEUED) {
+    return 0;
+  }
+  if (spawnq_len >= spawnq_alloc) {
+    int alloc = spawnq_alloc ? spawnq_alloc * 2 : 16;
+    int *q = (int *)realloc(spawnq, alloc * sizeof(int));
+    if (!q) {
+      return -1;
+    }
+    spawnq = q;
+    spawnq_alloc = alloc;
+  }
+  dbg("[%d:%s] deferred\n", sid, svname(sid));
+  sv.flags[sid] |= setup ? SV_QUEUED | SV_QSETUP : SV_QUEUED;
+  spawnq[spawnq_len++] = sid;
+  return 0;
+}
+
+/* start deferred services as long as the governor allows it */
+void spawn_drain() {
+  int i = 0;
+  while (i < spawnq_len && spawn_ok()) {
+    int sid = spawnq[i++];
+    int setup = sv.flags[sid] & SV_QSETUP;
+    sv.flags[sid] &= ~(SV_QUEUED | SV_QSETUP);
+    startnodep(sid, 0, setup);
+  }
+  memmove(spawnq, spawnq + i, (spawnq_len - i) * sizeof(int));
+  spawnq_len -= i;
+}
+
+/* read governor settings from the environment */
+void spawn_config() {
+  char *x = 0;
+  if ((x = getenv("NEO_SPAWN_MAX"))) {
+    spawn_max = atoi(x);
+  }
+  if ((x = getenv("NEO_SPAWN_PSI"))) {
+    spawn_psi = atoi(x);
+    if (spawn_psi > 0 && spawn_max <= 0) {
+      spawn_max = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    }
+  }
+  if ((x = getenv("NEO_SPAWN_SETTLE"))) {
+    spawn_settle = atoi(x);
+  }
+  if (spawn_max <= 0 || !(spawning = (int *)malloc(spawn_max * sizeof(int)))) {
+    spawn_max = 0;
+    return;
+  }
+  spawn_limit = spawn_max;
+}
+
+/* called from inside the service directory, return the PID or 0 on error */
+pid_t forkandexec(int sid, int pause, int setup) {
+  int count = 0;
+  pid_t pid = 0;
+  int sync = issync(sid);
+  unsigned long len = 0;
+  char *argdata = 0;
+  char **argv = 0;
   char *argv0 = 0;
   char *envdata = 0;
   char **env = 0;
 again:
-  switch (pid = fork()) {
+  switch (pid = sys.fork(sid, pause)) {
   case -1:
     if (count > 3) {
       return -1;
@@ -306,100 +1537,184 @@ again:
       req.tv_nsec = 500000000;
       nanosleep(&req, 0);
     }
-    if (!setup && !openreadclose("params", &argdata, &len)) {
-      len = 0;
-      argv = split(argdata, '\n', &len, 2, 1);
-      if (argv && len > 0) {
-        if (!*argv[len - 1]) {
-          argv[len - 1] = 0;
-        } else {
-          argv[len] = 0;
+    if (sv.flags[sid] & SV_JOB) {
+      /* VAR=val items up to the command set the environment of a job */
+      char *x = sv.cold[sid].job;
+      int n = 0;
+      argv = (char **)alloca((sv.cold[sid].joblen + 1) * sizeof(char *));
+      for (; x < sv.cold[sid].job + sv.cold[sid].joblen; x += str_len(x) + 1) {
+        if (n || x[0] == '=' || !strchr(x, '=')) {
+          argv[n++] = x;
+        } else if (str_start(x, "NEO_CGROUP=")) {
+          char *procs = (char *)alloca(str_len(x) + 3);
+          strcpy(procs, x + 11);
+          strcat(procs, "/cgroup.procs");
+          int fd = open(procs, O_WRONLY | O_CLOEXEC);
+          if (fd < 0 || write(fd, "0", 1) != 1) {
+            _exit(225);
+          }
+          close(fd);
+        } else if (str_start(x, "NEO_AFFINITY=")) {
+          cpu_set_t set;
+          cpulist(x + 13, &set);
+          sched_setaffinity(0, sizeof(set), &set);
+        }
+        if (!n) {
+          putenv(x);
         }
       }
-    }
-    if (!argv) {
-      argv = (char **)alloca(2 * sizeof(char *));
-      if (argv) {
-        argv[1] = 0;
+      argv[n] = 0;
+      argv0 = argv[0];
+    } else {
+      if (!setup && !sys.openreadclose("params", &argdata, &len)) {
+        len = 0;
+        argv = split(argdata, '\n', &len, 2, 1);
+        if (argv && len > 0) {
+          if (!*argv[len - 1]) {
+            argv[len - 1] = 0;
+          } else {
+            argv[len] = 0;
+          }
+        }
       }
-    }
-    argv0 = (char *)alloca(PATH_MAX + 1);
-    if (!argv || !argv0) {
-      _exit(225);
-    }
-    memset(argv0, 0, PATH_MAX + 1);
-    char *cmd = setup ? "setup" : "run";
-    if (readlink(cmd, argv0, PATH_MAX) < 0) {
-      if (errno == ENOENT) {
-        _exit(0);
+      if (!argv) {
+        argv = (char **)alloca(2 * sizeof(char *));
+        if (argv) {
+          argv[1] = 0;
+        }
+      }
+      argv0 = (char *)alloca(PATH_MAX + 1);
+      if (!argv || !argv0) {
+        _exit(225);
       }
-      if (errno != EINVAL) {
-        _exit(227);
+      memset(argv0, 0, PATH_MAX + 1);
+      char *cmd = setup ? "setup" : "run";
+      if (readlink(cmd, argv0, PATH_MAX) < 0) {
+        if (errno == ENOENT) {
+          _exit(0);
+        }
+        if (errno != EINVAL) {
+          _exit(227);
+        }
+        strcpy(argv0, cmd);
       }
-      strcpy(argv0, cmd);
-    }
-    argv[0] = strrchr(argv0, '/');
-    if (argv[0]) {
-      argv[0]++;
-    } else {
-      argv[0] = argv0;
-    }
-    if (!setup && !openreadclose("environ", &envdata, &len)) {
-      len = 0;
-      env = split(envdata, '\n', &len, 0, 0);
-      if (env) {
-        for (int i = 0; i < len; ++i) {
-          if (*env[i]) {
-            putenv(env[i]);
+      argv[0] = strrchr(argv0, '/');
+      if (argv[0]) {
+        argv[0]++;
+      } else {
+        argv[0] = argv0;
+      }
+      if (!setup && !sys.openreadclose("environ", &envdata, &len)) {
+        len = 0;
+        env = split(envdata, '\n', &len, 0, 0);
+        if (env) {
+          for (int i = 0; i < len; ++i) {
+            if (*env[i]) {
+              putenv(env[i]);
+            }
           }
+          free(env);
         }
-        free(env);
       }
     }
-    char *env_service = (char *)alloca(str_len(svlist[sid].name) + 13);
+    char *env_service = (char *)alloca(str_len(svname(sid)) + 13);
     if (env_service) {
       strcpy(env_service, "NEO_SERVICE=");
-      strcat(env_service, svlist[sid].name);
+      strcat(env_service, svname(sid));
       putenv(env_service);
     }
-    if (svlist[sid].__stdin != 0) {
-      if (dup2(svlist[sid].__stdin, 0)) {
+    if (spawn_standby) {
+      putenv("NEO_STANDBY=1");
+    }
+    if (sv.flags[sid] & SV_INSTANCE) {
+      char *instance = strchr(svname(sid), '@') + 1;
+      char *env_instance = (char *)alloca(str_len(instance) + 14);
+      strcpy(env_instance, "NEO_INSTANCE=");
+      strcat(env_instance, instance);
+      putenv(env_instance);
+      if (sv.cold[sid].ncpus && *instance >= '0' && *instance <= '9') {
+        /* pin numbered instances round robin to the CPUs of the template */
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(sv.cold[sid].cpus[atoi(instance) % sv.cold[sid].ncpus], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+      }
+    }
+    if (sv.cold[sid].__stdin != 0) {
+      if (dup2(sv.cold[sid].__stdin, 0)) {
         _exit(225);
       }
       if (fcntl(0, F_SETFD, 0)) {
         _exit(225);
       }
     }
-    if (svlist[sid].__stdout != 1) {
-      if (dup2(svlist[sid].__stdout, 1) || dup2(svlist[sid].__stdout, 2)) {
+    if (sv.cold[sid].__stdout != 1) {
+      if (dup2(sv.cold[sid].__stdout, 1) < 0 || dup2(sv.cold[sid].__stdout, 2) < 0) {
         _exit(225);
       }
       if (fcntl(1, F_SETFD, 0) || fcntl(2, F_SETFD, 0)) {
         _exit(225);
       }
     }
-    for (int i = 3; i < 1024; ++i) {
+    int nlfd = setup ? 0 : sv.cold[sid].nlfd;
+    int nfd = setup ? 0 : nlfd + sv.cold[sid].nstore;
+    if (nfd) {
+      /* pass listening sockets and stored fds as fds 3.., move them out of the way first */
+      char *env_fds = (char *)alloca(11 + FMT_ULONG);
+      char *env_pid = (char *)alloca(11 + FMT_ULONG);
+      int *tmp = (int *)alloca(nfd * sizeof(int));
+      unsigned long names_len = 16;
+      for (int i = 0; i < nfd; ++i) {
+        int fd = i < nlfd ? sv.cold[sid].lfd[i] : sv.cold[sid].store[i - nlfd].fd;
+        if ((tmp[i] = fcntl(fd, F_DUPFD_CLOEXEC, 3 + nfd)) < 0) {
+          _exit(225);
+        }
+        names_len += (i < nlfd ? 6 : str_len(sv.cold[sid].store[i - nlfd].name)) + 1;
+      }
+      char *env_names = (char *)alloca(names_len);
+      strcpy(env_names, "LISTEN_FDNAMES=");
+      for (int i = 0; i < nfd; ++i) {
+        if (dup2(tmp[i], 3 + i) != 3 + i) {
+          _exit(225);
+        }
+        if (i) {
+          strcat(env_names, ":");
+        }
+        strcat(env_names, i < nlfd ? "listen" : sv.cold[sid].store[i - nlfd].name);
+      }
+      strcpy(env_fds, "LISTEN_FDS=");
+      env_fds[11 + fmt_ulong(env_fds + 11, nfd)] = 0;
+      putenv(env_fds);
+      strcpy(env_pid, "LISTEN_PID=");
+      env_pid[11 + fmt_ulong(env_pid + 11, getpid())] = 0;
+      putenv(env_pid);
+      putenv(env_names);
+    }
+    for (int i = 3 + nfd; i < 1024; ++i) {
       close(i);
     }
-    execve(argv0, argv, environ);
+    if (sv.flags[sid] & SV_JOB) {
+      execvp(argv0, argv);
+    } else {
+      execve(argv0, argv, environ);
+    }
     _exit(226);
   default:
-    dbg("[%d:%s] pid %d\n", sid, svlist[sid].name, pid);
-    svlist[sid].pid = pid;
-    // sync on service 'boot' and depends
-    if ((sid == 0 || svlist[sid].sid_father == 0) && !strcmp(svlist[0].name, "boot")) {
-      sync = 1;
-    } else {
-      int fd = open("sync", O_RDONLY | O_CLOEXEC);
-      if (fd >= 0) {
-        close(fd);
-        sync = 1;
-      }
+    dbg("[%d:%s] pid %d\n", sid, svname(sid), pid);
+    trace(TR_FORK, sid, pid, 0);
+    sv.cold[sid].spawns++;
+    if (sv.cold[sid].respawn_us) {
+      hist_add(&respawn_hist, usnow() - sv.cold[sid].respawn_us);
+      sv.cold[sid].respawn_us = 0;
     }
+    metrics_dirty = 1;
+    sv.pid[sid] = pid;
     if (sync) {
+      struct rusage ru;
       int status = 0;
-      waitpid(pid, &status, 0);
-      svlist[sid].respawn = 0;
+      sys.wait4(pid, &status, 0, &ru);
+      sv.flags[sid] &= ~SV_RESPAWN;
+      reaped = &ru;
       handlekilled(pid, status);
     }
     return 0;
@@ -411,22 +1726,52 @@ int startnodep(int sid, int pause, int setup) {
   if (isup(sid)) {
     return 0;
   }
-  if (chdir(NEOROOT) || chdir(svlist[sid].name)) {
+  if (svchdir(sid)) {
     return -1;
   }
+  if (sv.flags[sid] & SV_QUEUED) {
+    return 0;
+  }
+  if ((sv.flags[sid] & SV_LAZY) && sv.cold[sid].nlfd && !(sv.flags[sid] & SV_WAKE)) {
+    dbg("[%d:%s] WAITING\n", sid, svname(sid));
+    state_set(sid, SID_WAITING);
+    sv.cold[sid].changed_at = sys.time(0);
+    return 0;
+  }
+  if (spawn_max && !issync(sid)) {
+    if (!spawn_ok()) {
+      /* a woken lazy service stays woken until it is started */
+      return spawn_defer(sid, setup);
+    }
+    spawning[nspawning++] = sid;
+  }
+  sv.flags[sid] &= ~SV_WAKE;
 
   memmove(history + 1, history, sizeof(int) * ((HISTORY)-1));
   history[0] = sid;
 
   if (setup) {
-    dbg("[%d:%s] SETUP\n", sid, svlist[sid].name);
-    svlist[sid].state = SID_SETUP;
+    dbg("[%d:%s] SETUP\n", sid, svname(sid));
+    state_set(sid, SID_SETUP);
   } else {
-    dbg("[%d:%s] ACTIVE\n", sid, svlist[sid].name);
-    svlist[sid].state = SID_ACTIVE;
+    dbg("[%d:%s] ACTIVE\n", sid, svname(sid));
+    state_set(sid, SID_ACTIVE);
   }
-  svlist[sid].changed_at = time(0); /* set start time */
-  return forkandexec(sid, pause, setup);
+  sv.cold[sid].changed_at = sys.time(0); /* set start time */
+  sv.cold[sid].started_ms = msnow();
+  sv.flags[sid] &= ~SV_READY;
+  if (forkandexec(sid, pause, setup)) {
+    return -1;
+  }
+  if (!setup && (sv.flags[sid] & SV_STANDBY)) {
+    sv.cold[sid].standby_quick = 0;
+    standby_check(sid, 0);
+  }
+  if ((sv.flags[sid] & SV_JOB) && isrunning(sid)) {
+    /* free the slot in its queue for the next job at once */
+    sv.cold[sid].pidfd = syscall(SYS_pidfd_open, sv.pid[sid], 0);
+  }
+  return 0;
 }
 
 int startservice(int sid, int pause, int sid_father) {
@@ -434,24 +1779,26 @@ int startservice(int sid, int pause, int sid_father) {
   if (sid < 0) {
     return 0;
   }
-  if (svlist[sid].circular) {
+  if (sv.flags[sid] & SV_CIRCULAR) {
     return 0;
   }
-  svlist[sid].circular = 1;
-  svlist[sid].sid_father = sid_father;
-  dbg("[%d:%s] starting\n", sid, svlist[sid].name);
-  // dbg("[%d:%s] parent %d %s\n", sid, svlist[sid].name, sid_father,
-  //     sid_father >= 0 ? svlist[sid_father].name : "neoinit");
-  if (svlist[sid].sid_log >= 0) {
-    startservice(svlist[sid].sid_log, pause, sid);
+  sv.flags[sid] |= SV_CIRCULAR;
+  sv.cold[sid].sid_father = sid_father;
+  dbg("[%d:%s] starting\n", sid, svname(sid));
+  // dbg("[%d:%s] parent %d %s\n", sid, svname(sid), sid_father,
+  //     sid_father >= 0 ? svname(sid_father) : "neoinit");
+  cleardeps(sid);
+  if (sv.cold[sid].sid_log >= 0) {
+    adddep(sid, sv.cold[sid].sid_log);
+    startservice(sv.cold[sid].sid_log, pause, sid);
   }
-  if (chdir(NEOROOT) || chdir(svlist[sid].name)) {
+  if (svchdir(sid)) {
     return -1;
   }
   if ((dir = open(".", O_RDONLY | O_CLOEXEC)) >= 0) {
     unsigned long len = 0;
     char *depdata = 0;
-    if (!openreadclose("depends", &depdata, &len)) {
+    if (!sys.openreadclose("depends", &depdata, &len)) {
       len = 0;
       char **depv = split(depdata, '\n', &len, 0, 0);
       if (depv) {
@@ -459,10 +1806,13 @@ int startservice(int sid, int pause, int sid_father) {
           if (depv[i][0] == 0 || depv[i][0] == '#') {
             continue;
           }
-          dbg("[%d:%s] depends: %s\n", sid, svlist[sid].name, depv[i]);
+          dbg("[%d:%s] depends: %s\n", sid, svname(sid), depv[i]);
           int sid_dep = loadservice(depv[i]);
-          if (sid_dep >= 0 && !isup(sid_dep)) {
-            startservice(sid_dep, 0, sid);
+          if (sid_dep >= 0) {
+            adddep(sid, sid_dep);
+            if (!isup(sid_dep)) {
+              startservice(sid_dep, 0, sid);
+            }
           }
         }
         free(depv);
@@ -480,49 +1830,1587 @@ int startservice(int sid, int pause, int sid_father) {
       close(fd);
       setup = 1;
     }
+    if (sv.flags[sid] & SV_TEMPLATE) {
+      return scale(sid, pause);
+    }
     return startnodep(sid, pause, setup);
   }
   return -1;
 }
 
-void childhandler() {
-  pid_t killed = 0;
-  int status = 0;
-  do {
-    killed = waitpid(-1, &status, WNOHANG);
-    if (killed != -1) {
-      handlekilled(killed, status);
+/* start the instances of template sid up to its count and stop the ones
+ * above, return nonzero on error */
+int scale(int sid, int pause) {
+  char *name = (char *)alloca(str_len(svname(sid)) + FMT_ULONG + 1);
+  int ret = 0;
+  dbg("[%d:%s] instances %d\n", sid, svname(sid), sv.cold[sid].instances);
+  state_set(sid, SID_ACTIVE);
+  sv.pid[sid] = PID_DOWN;
+  sv.cold[sid].changed_at = sys.time(0);
+  for (int i = 0;; ++i) {
+    unsigned long len = str_len(svname(sid));
+    memcpy(name, svname(sid), len);
+    name[len + fmt_ulong(name + len, i)] = 0;
+    int si = i < sv.cold[sid].instances ? loadservice(name) : findservice(name);
+    if (si < 0) {
+      if (i < sv.cold[sid].instances) {
+        ret = -1;
+        continue;
+      }
+      break;
     }
-    // TODO check errno
-  } while (killed && killed != -1);
-
-  for (int sid = 0; sid <= sv_max; ++sid) {
-    if (isrunning(sid)) {
-      if (kill(svlist[sid].pid, 0)) {
-        handlekilled(svlist[sid].pid, 0);
-      } else {
-        killed = 0;
+    if (i < sv.cold[sid].instances) {
+      adddep(sid, si);
+      if (!isrunning(si) && (sv.state[si] == SID_INIT || sv.state[si] == SID_STOPPED)) {
+        state_set(si, SID_INIT);
+        sv.flags[si] &= ~SV_CIRCULAR;
+        if (startservice(si, pause, sid)) {
+          ret = -1;
+        }
+      }
+    } else {
+      edge_drop(&sv.cold[sid].deps, si);
+      edge_drop(&sv.cold[si].rdeps, sid);
+      if (sv.state[si] != SID_STOPPED &&
+          (isrunning(si) || sv.state[si] == SID_WAITING || (sv.flags[si] & SV_QUEUED))) {
+        dbg("[%d:%s] STOPPED\n", si, svname(si));
+        state_set(si, SID_STOPPED);
+        if (isrunning(si) && !sys.kill(sv.pid[si], SIGTERM)) {
+          sys.kill(sv.pid[si], SIGCONT);
+        }
       }
     }
   }
-  if (killed == -1) {
-    if (iam_init) {
-      wout("neoinit: all services exited\n");
+  return ret;
+}
+
+/* add path to the readahead set unless already recorded */
+void ra_add(const char *path) {
+  unsigned long len = str_len(path) + 1;
+  if (ra_used * 2 >= ra_slots) {
+    unsigned long slots = ra_slots ? ra_slots * 2 : 256;
+    unsigned long *slot = calloc(slots, sizeof(unsigned long));
+    if (!slot) {
+      return;
     }
-    if (confdata) {
-      free(confdata);
+    for (unsigned long i = 0; i < ra_slots; ++i) {
+      if (ra_slot[i]) {
+        unsigned long j = strhash(ra_data + ra_slot[i] - 1) & (slots - 1);
+        while (slot[j]) {
+          j = (j + 1) & (slots - 1);
+        }
+        slot[j] = ra_slot[i];
+      }
+    }
+    free(ra_slot);
+    ra_slot = slot;
+    ra_slots = slots;
+  }
+  unsigned long i = strhash(path) & (ra_slots - 1);
+  while (ra_slot[i]) {
+    if (!strcmp(ra_data + ra_slot[i] - 1, path)) {
+      return;
+    }
+    i = (i + 1) & (ra_slots - 1);
+  }
+  if (ra_len + len > ra_alloc) {
+    unsigned long alloc = ra_alloc ? ra_alloc * 2 : 4096;
+    while (ra_len + len > alloc) {
+      alloc *= 2;
+    }
+    char *data = realloc(ra_data, alloc);
+    if (!data) {
+      return;
+    }
+    ra_data = data;
+    ra_alloc = alloc;
+  }
+  memcpy(ra_data + ra_len, path, len);
+  ra_slot[i] = ra_len + 1;
+  ra_len += len;
+  ++ra_used;
+  ra_dirty = 1;
+  ra_added = msnow();
+}
+
+/* record run target and mapped files of services started since last call */
+void ra_sample() {
+  static char *maps;
+  static unsigned long alloc;
+  time_t now = sys.time(0);
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    if ((sv.flags[sid] & SV_MAPPED) || sv.state[sid] == SID_INIT) {
+      continue;
+    }
+    if (isrunning(sid) && now - sv.cold[sid].changed_at < 1) {
+      continue; /* let it exec and settle first */
+    }
+    sv.flags[sid] |= SV_MAPPED;
+    char run[sizeof(NEOROOT "/") + PATH_MAX + 4];
+    strcpy(run, NEOROOT "/");
+    strcat(run, svname(sid));
+    strcat(run, "/run");
+    if (!access(run, F_OK)) {
+      ra_add(run);
+    }
+    if (!isrunning(sid)) {
+      continue;
+    }
+    char fn[sizeof("/proc//maps") + FMT_ULONG];
+    unsigned long len = fmt_ulong(fn + 6, sv.pid[sid]);
+    long r;
+    memcpy(fn, "/proc/", 6);
+    strcpy(fn + 6 + len, "/maps");
+    /* procfs reports no size, read until EOF */
+    int fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    len = 0;
+    do {
+      if (len == alloc) {
+        char *b = (char *)realloc(maps, alloc * 2 + 65536 + 1);
+        if (!b) {
+          break; /* record what was read */
+        }
+        maps = b;
+        alloc = alloc * 2 + 65536;
+      }
+      r = read(fd, maps + len, alloc - len);
+      len += r > 0 ? r : 0;
+    } while (r > 0);
+    close(fd);
+    if (maps) {
+      maps[len] = 0;
+      for (char *s = maps; *s;) {
+        char *eol = strchr(s, '\n');
+        if (eol) {
+          *eol = 0;
+        }
+        char *path = strchr(s, '/');
+        if (path && strncmp(path, "/dev/", 5) && !strstr(path, " (deleted)")) {
+          ra_add(path);
+        }
+        if (!eol) {
+          break;
+        }
+        s = eol + 1;
+      }
+    }
+  }
+}
+
+/* write the recorded readahead set, one path per line */
+void ra_save() {
+  char *data = malloc(ra_len);
+  if (!data) {
+    return;
+  }
+  ra_dirty = 0;
+  for (unsigned long i = 0; i < ra_len; ++i) {
+    data[i] = ra_data[i] ? ra_data[i] : '\n';
+  }
+  int fd = open(READAHEAD ".new", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd >= 0) {
+    long len = write(fd, data, ra_len);
+    if (close(fd) || len != ra_len || rename(READAHEAD ".new", READAHEAD)) {
+      unlink(READAHEAD ".new");
+    }
+  }
+  free(data);
+}
+
+/* prefetch the files recorded on last boot in the background */
+void ra_boot() {
+  unsigned long len = 0;
+  char *radata = 0;
+  int fd = open(READAHEAD, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  close(fd);
+  ra_enabled = 1;
+  if (sys.openreadclose(READAHEAD, &radata, &len)) {
+    return;
+  }
+  switch (fork()) {
+  case -1:
+    break;
+  case 0:
+    for (char *s = radata; *s;) {
+      char *eol = strchr(s, '\n');
+      if (eol) {
+        *eol = 0;
+      }
+      if ((fd = open(s, O_RDONLY | O_CLOEXEC)) >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+      }
+      if (!eol) {
+        break;
+      }
+      s = eol + 1;
+    }
+    _exit(0);
+  default:
+    break;
+  }
+  free(radata);
+}
+
+/* mark sid and everything it depends on to be stopped,
+ * if all is set mark all services but sid instead */
+int stop_begin(int sid, int all) {
+  if (all) {
+    for (int si = 0; si <= sv_max; ++si) {
+      sv.flags[si] |= SV_STOPPING;
+    }
+    if (sid >= 0) {
+      sv.flags[sid] &= ~SV_STOPPING;
+    }
+  } else {
+    int *stack = (int *)malloc((sv_max + 1) * sizeof(int));
+    int n = 0;
+    if (!stack) {
+      return -1;
+    }
+    sv.flags[sid] |= SV_STOPPING;
+    stack[n++] = sid;
+    while (n) {
+      edges_t *deps = &sv.cold[stack[--n]].deps;
+      for (int i = 0; i < deps->n; ++i) {
+        if (!(sv.flags[deps->v[i]] & SV_STOPPING)) {
+          sv.flags[deps->v[i]] |= SV_STOPPING;
+          stack[n++] = deps->v[i];
+        }
+      }
+    }
+    free(stack);
+  }
+  /* keep what is still needed by running services not being stopped */
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (int si = 0; si <= sv_max; ++si) {
+      if (!(sv.flags[si] & SV_STOPPING) || (si == sid && !all)) {
+        continue;
+      }
+      edges_t *rdeps = &sv.cold[si].rdeps;
+      for (int i = 0; i < rdeps->n; ++i) {
+        if (!(sv.flags[rdeps->v[i]] & SV_STOPPING) && isrunning(rdeps->v[i])) {
+          sv.flags[si] &= ~SV_STOPPING;
+          changed = 1;
+          break;
+        }
+      }
+    }
+  }
+  for (int si = 0; si <= sv_max; ++si) {
+    if ((sv.flags[si] & SV_STOPPING) &&
+        ((sv.flags[si] & SV_QUEUED) || ((sv.flags[si] & SV_JOB) && sv.state[si] == SID_INIT))) {
+      dbg("[%d:%s] STOPPED\n", si, svname(si));
+      state_set(si, SID_STOPPED); /* dropped when the spawn or job queue is drained */
+      sv.pid[si] = PID_DOWN;
+    } else if ((sv.flags[si] & SV_STOPPING) &&
+               (sv.state[si] == SID_WAITING ||
+                ((sv.flags[si] & SV_TEMPLATE) && sv.state[si] == SID_ACTIVE))) {
+      dbg("[%d:%s] STOPPED\n", si, svname(si));
+      state_set(si, SID_STOPPED);
+    }
+  }
+  stop_pending = 1;
+  return 0;
+}
+
+/* return seconds to wait for a stopping service before it is killed */
+unsigned long stop_timeout(int sid) {
+  unsigned long timeout = STOP_TIMEOUT;
+  unsigned long len = 0;
+  char *data = 0;
+  char *x = getenv("NEO_STOP_TIMEOUT");
+  if (x) {
+    timeout = atoi(x);
+  }
+  if (!svchdir(sid) && !sys.openreadclose("timeout", &data, &len)) {
+    timeout = atoi(data);
+    free(data);
+  }
+  return timeout;
+}
+
+/* signal stopping services whose dependents are down, reply when all are down */
+void stop_step() {
+  unsigned long now = msnow();
+  int running = 0;
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    if (!(sv.flags[sid] & SV_STOPPING) || !isrunning(sid)) {
+      continue;
+    }
+    running = 1;
+    if (sv.state[sid] != SID_STOPPED || !sv.cold[sid].stop_ms) {
+      edges_t *rdeps = &sv.cold[sid].rdeps;
+      int i = 0;
+      while (i < rdeps->n && !((sv.flags[rdeps->v[i]] & SV_STOPPING) && isrunning(rdeps->v[i]))) {
+        ++i;
+      }
+      if (i < rdeps->n) {
+        continue; /* stop dependents first */
+      }
+      dbg("[%d:%s] STOPPED\n", sid, svname(sid));
+      state_set(sid, SID_STOPPED);
+      sv.cold[sid].stop_ms = now + stop_timeout(sid) * 1000;
+      if (!sys.kill(sv.pid[sid], SIGTERM)) {
+        sys.kill(sv.pid[sid], SIGCONT);
+      }
+    } else if (!(sv.flags[sid] & SV_KILLED) && (long)(now - sv.cold[sid].stop_ms) >= 0) {
+      dbg("[%d:%s] kill\n", sid, svname(sid));
+      sv.flags[sid] |= SV_KILLED;
+      sys.kill(sv.pid[sid], SIGKILL);
+    }
+  }
+  if (!running) {
+    for (int sid = 0; sid <= sv_max; ++sid) {
+      sv.flags[sid] &= ~(SV_STOPPING | SV_KILLED);
+      sv.cold[sid].stop_ms = 0;
+    }
+    stop_pending = 0;
+    write_checked(outfd, "1", 1);
+  }
+}
+
+/* finish the restart of sid, fall back to the previous instance unless ok
+ * and it is still running */
+void restart_end(int sid, int ok) {
+  if (!ok) {
+    dbg("[%d:%s] restart failed\n", sid, svname(sid));
+  }
+  if (!ok && sv.cold[sid].pid_old > 1) {
+    sv.pid[sid] = sv.cold[sid].pid_old;
+    state_set(sid, SID_ACTIVE);
+  }
+  sv.cold[sid].pid_old = 0;
+  sv.cold[sid].stop_ms = 0;
+  sv.flags[sid] &= ~SV_KILLED;
+  restart_sid = -1;
+  write_checked(outfd, ok ? "1" : "0", 1);
+}
+
+/* start a new instance of a running service next to the previous one,
+ * which is stopped once the new one is ready. return nonzero on error */
+int restart_begin(int sid) {
+  if (!isrunning(sid) || sv.state[sid] != SID_ACTIVE) {
+    return -1;
+  }
+  dbg("[%d:%s] restart\n", sid, svname(sid));
+  if (sv.cold[sid].pidfd >= 0) {
+    close(sv.cold[sid].pidfd);
+    sv.cold[sid].pidfd = -1;
+  }
+  sv.cold[sid].pid_old = sv.pid[sid];
+  sv.cold[sid].stop_ms = 0;
+  sv.pid[sid] = PID_DOWN;
+  state_set(sid, SID_INIT);
+  sv.flags[sid] |= SV_WAKE;
+  restart_sid = sid;
+  restart_stopping = 0;
+  if (startnodep(sid, 0, 0) && restart_sid == sid) {
+    restart_end(sid, 0);
+  }
+  return 0;
+}
+
+/* stop the previous instance once the new one is ready, kill the new one if
+ * it does not get ready in time, reply when the previous one is down */
+void restart_step() {
+  int sid = restart_sid;
+  sv_t *cold = &sv.cold[sid];
+  unsigned long now = msnow();
+  int ready = isrunning(sid) && (!(sv.flags[sid] & SV_NOTIFY) || (sv.flags[sid] & SV_READY));
+  if (cold->pid_old > 1 && sys.kill(cold->pid_old, 0) && errno == ESRCH) {
+    cold->pid_old = 0; /* not a child of neoinit, e.g. from a pidfile */
+  }
+  if (cold->pid_old <= 1 && (restart_stopping || ready)) {
+    /* the previous instance is down, early or stopped, and the new one ready */
+    restart_end(sid, 1);
+  } else if (!restart_stopping) {
+    if (!isrunning(sid)) {
+      return; /* deferred by the governor */
+    }
+    if (!cold->stop_ms) {
+      cold->stop_ms = now + stop_timeout(sid) * 1000;
+    }
+    if (!ready) {
+      if (!(sv.flags[sid] & SV_KILLED) && (long)(now - cold->stop_ms) >= 0) {
+        dbg("[%d:%s] not ready, kill\n", sid, svname(sid));
+        sv.flags[sid] |= SV_KILLED;
+        sys.kill(sv.pid[sid], SIGKILL);
+      }
+      return;
+    }
+    dbg("[%d:%s] stopping previous instance\n", sid, svname(sid));
+    restart_stopping = 1;
+    cold->stop_ms = now + stop_timeout(sid) * 1000;
+    if (!sys.kill(cold->pid_old, SIGTERM)) {
+      sys.kill(cold->pid_old, SIGCONT);
+    }
+  } else if (!(sv.flags[sid] & SV_KILLED) && (long)(now - cold->stop_ms) >= 0) {
+    dbg("[%d:%s] kill previous instance\n", sid, svname(sid));
+    sv.flags[sid] |= SV_KILLED;
+    sys.kill(cold->pid_old, SIGKILL);
+  }
+}
+
+/* watch the running service sid for a prompt failover and start its standby
+ * unless there is one or STANDBY_TRIES of them in a row exited within a
+ * second. The standby runs with NEO_STANDBY=1 */
+void standby_check(int sid, int pause) {
+  sv_t *cold = &sv.cold[sid];
+  pid_t pid = sv.pid[sid];
+  if (!isrunning(sid) || sv.state[sid] != SID_ACTIVE) {
+    return;
+  }
+  if (cold->pidfd < 0) {
+    cold->pidfd = syscall(SYS_pidfd_open, pid, 0);
+  }
+  if (cold->pid_standby > 1 || cold->standby_quick >= STANDBY_TRIES || svchdir(sid) ||
+      issync(sid)) {
+    return;
+  }
+  spawn_standby = 1;
+  if (!forkandexec(sid, pause, 0)) {
+    dbg("[%d:%s] standby\n", sid, svname(sid));
+    cold->pid_standby = sv.pid[sid];
+    cold->standby_ms = msnow();
+    cold->pidfd_standby = syscall(SYS_pidfd_open, cold->pid_standby, 0);
+  }
+  spawn_standby = 0;
+  sv.pid[sid] = pid;
+}
+
+/* add a job to the queue given as name[:max], data are its VAR=val items
+ * and command line separated by 0, return its index or -1 */
+int job_submit(char *queue, char *data, unsigned long len) {
+  unsigned long qlen = str_chr(queue, ':');
+  char *name = (char *)alloca(qlen + FMT_ULONG + 2);
+  char *x = data;
+  int q = 0;
+  sv_t cold;
+  while (x < data + len && x[0] != '=' && strchr(x, '=')) {
+    x += str_len(x) + 1;
+  }
+  if (!qlen || strcspn(queue, "/@#") < qlen || x >= data + len || !*x) {
+    return -1;
+  }
+  while (q < njobq && (str_len(jobq[q].name) != qlen || memcmp(jobq[q].name, queue, qlen))) {
+    ++q;
+  }
+  if (q == njobq) {
+    if (grow(&jobq, njobq + 1, sizeof(jobq_t)) || !(jobq[q].name = strndup(queue, qlen))) {
+      return -1;
+    }
+    jobq[q].max = 1;
+    ++njobq;
+  }
+  if (queue[qlen] == ':' && atoi(queue + qlen + 1) > 0) {
+    jobq[q].max = atoi(queue + qlen + 1);
+  }
+  memset(&cold, 0, sizeof(sv_t));
+  cold.sid_father = -1;
+  cold.sid_log = -1;
+  cold.pidfd = -1;
+  cold.pidfd_standby = -1;
+  cold.exitcode = -1;
+  cold.__stdin = 0;
+  cold.__stdout = 1;
+  cold.queue = q;
+  if (!(cold.job = (char *)malloc(len + 1))) {
+    return -1;
+  }
+  memcpy(cold.job, data, len);
+  cold.job[len] = 0;
+  cold.joblen = len;
+  memcpy(name, queue, qlen);
+  name[qlen] = '#';
+  name[qlen + 1 + fmt_ulong(name + qlen + 1, ++jobs)] = 0;
+  /* keep the last JOB_KEEP finished jobs of the queue, reuse the oldest */
+  int kept = 0, oldest = -1;
+  unsigned long n, first = ULONG_MAX;
+  for (int si = 0; si <= sv_max; ++si) {
+    if ((sv.flags[si] & SV_JOB) && sv.cold[si].queue == q && isup(si) && !isrunning(si) &&
+        !(sv.flags[si] & SV_QUEUED)) {
+      kept++;
+      if ((n = strtoul(strchr(svname(si), '#') + 1, 0, 10)) < first) {
+        first = n;
+        oldest = si;
+      }
+    }
+  }
+  int sid = kept >= JOB_KEEP ? reusesv(oldest, name, SV_JOB, &cold) : addsv(name, SV_JOB, &cold);
+  if (sid < 0) {
+    free(cold.job);
+    return -1;
+  }
+  dbg("[%d:%s] queued\n", sid, svname(sid));
+  return sid;
+}
+
+/* start waiting jobs in submission order while their queue has a free slot */
+void jobs_drain() {
+  int *running = (int *)alloca(njobq * sizeof(int));
+  memset(running, 0, njobq * sizeof(int));
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    if ((sv.flags[sid] & SV_JOB) && (isrunning(sid) || (sv.flags[sid] & SV_QUEUED))) {
+      running[sv.cold[sid].queue]++;
+    }
+  }
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    int q = sv.cold[sid].queue;
+    if (!(sv.flags[sid] & SV_JOB) || sv.state[sid] != SID_INIT || (sv.flags[sid] & SV_QUEUED) ||
+        running[q] >= jobq[q].max) {
+      continue;
+    }
+    running[q]++;
+    startnodep(sid, 0, 0);
+  }
+}
+
+/* create the socket services send notifications and fds to, named
+ * @neoinit/<pid> in NOTIFY_SOCKET */
+void notify_open() {
+  struct sockaddr_un sa;
+  unsigned long len = 9;
+  int one = 1;
+  char *env;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path + 1, "neoinit/");
+  len += fmt_ulong(sa.sun_path + len, getpid());
+  if ((notifyfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+    return;
+  }
+  if (setsockopt(notifyfd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) ||
+      bind(notifyfd, (struct sockaddr *)&sa, offsetof(struct sockaddr_un, sun_path) + len) ||
+      !(env = (char *)malloc(len + 15))) {
+    close(notifyfd);
+    notifyfd = -1;
+    return;
+  }
+  strcpy(env, "NOTIFY_SOCKET=@");
+  memcpy(env + 15, sa.sun_path + 1, len - 1);
+  env[14 + len] = 0;
+  putenv(env);
+}
+
+/* return the parent of pid from /proc/<pid>/stat, 0 if unknown */
+pid_t parentpid(pid_t pid) {
+  char fn[sizeof("/proc//stat") + FMT_ULONG] = "/proc/";
+  char buf[512];
+  pid_t ppid = 0;
+  unsigned char c;
+  fn[6 + fmt_ulong(fn + 6, pid)] = 0;
+  strcat(fn, "/stat");
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  long len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[len > 0 ? len : 0] = 0;
+  /* pid (comm) state ppid, comm may contain spaces and parentheses */
+  char *x = strrchr(buf, ')');
+  if (!x || !x[1] || !x[2] || !x[3]) {
+    return 0;
+  }
+  x += 4;
+  while ((c = *x++ - '0') < 10) {
+    ppid = ppid * 10 + c;
+  }
+  return ppid;
+}
+
+/* handle a notification: READY=1 marks the service ready, FDSTORE=1 keeps
+ * the passed fds under FDNAME, FDSTOREREMOVE=1 closes the fds stored under
+ * FDNAME. The service is that of the sender pid or of its closest ancestor
+ * with one, whatever its uid. Only a privileged sender outside of all
+ * services may name it by SERVICE. return nonzero if the message was ignored */
+int notify_msg(struct ucred *cred, char *data, int *fds, int nfds) {
+  char *name = "stored";
+  int store = 0, remove = 0, ready = 0;
+  int sid = -1;
+  if (!cred) {
+    return -1;
+  }
+  for (pid_t pid = cred->pid; sid < 0 && pid > 1 && pid != getpid(); pid = parentpid(pid)) {
+    sid = findbypid(pid);
+  }
+  int named = sid < 0 && (!cred->uid || cred->uid == geteuid());
+  for (char *line = data; *line;) {
+    char *end = line + str_chr(line, '\n');
+    if (*end) {
+      *end++ = 0;
+    }
+    if (!strcmp(line, "READY=1")) {
+      ready = 1;
+    } else if (!strcmp(line, "FDSTORE=1")) {
+      store = 1;
+    } else if (!strcmp(line, "FDSTOREREMOVE=1")) {
+      remove = 1;
+    } else if (str_start(line, "FDNAME=") && line[7] && !strchr(line, ':')) {
+      name = line + 7;
+    } else if (str_start(line, "SERVICE=") && named) {
+      sid = findservice(line + 8);
+    }
+    line = end;
+  }
+  if (sid < 0) {
+    return -1;
+  }
+  if (ready && !(sv.flags[sid] & SV_READY)) {
+    dbg("[%d:%s] ready\n", sid, svname(sid));
+    sv.flags[sid] |= SV_READY;
+  }
+  if (remove) {
+    fdstore_drop(sid, name);
+  }
+  for (int i = 0; store && i < nfds; ++i) {
+    sv_t *cold = &sv.cold[sid];
+    char *x;
+    if (cold->nstore >= FDSTORE_MAX || grow(&cold->store, cold->nstore + 1, sizeof(fdstore_t)) ||
+        !(x = strdup(name))) {
+      break;
+    }
+    dbg("[%d:%s] fdstore %s\n", sid, svname(sid), name);
+    cold->store[cold->nstore].fd = fds[i];
+    cold->store[cold->nstore++].name = x;
+    fds[i] = -1;
+  }
+  return 0;
+}
+
+/* read all pending notifications, acknowledge them to senders with a name */
+void notify_read() {
+  struct sockaddr_un from;
+  char data[BUFSIZE + 1];
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(FDSTORE_MAX * sizeof(int))];
+  } ctl;
+  struct iovec iov = {data, BUFSIZE};
+  struct msghdr mh;
+  long len;
+  for (;;) {
+    struct ucred *cred = 0;
+    int *fds = 0;
+    int nfds = 0;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &from;
+    mh.msg_namelen = sizeof(from);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = &ctl;
+    mh.msg_controllen = sizeof(ctl);
+    if ((len = recvmsg(notifyfd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0) {
+      return;
+    }
+    data[len] = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+      if (c->cmsg_level != SOL_SOCKET) {
+        continue;
+      }
+      if (c->cmsg_type == SCM_CREDENTIALS) {
+        cred = (struct ucred *)CMSG_DATA(c);
+      } else if (c->cmsg_type == SCM_RIGHTS) {
+        fds = (int *)CMSG_DATA(c);
+        nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      }
+    }
+    int ret = notify_msg(cred, data, fds, nfds);
+    if (mh.msg_namelen > offsetof(struct sockaddr_un, sun_path)) {
+      sendto(notifyfd, ret ? "0" : "1", 1, MSG_DONTWAIT, (struct sockaddr *)&from, mh.msg_namelen);
+    }
+    for (int i = 0; i < nfds; ++i) {
+      if (fds[i] >= 0) {
+        close(fds[i]);
+      }
+    }
+  }
+}
+
+/* build the poll set of the control fifo, the notify socket, the pidfds of
+ * services with a standby and of jobs and the fds of waiting services,
+ * return its size */
+int pollset(struct pollfd *ctl, int nctl) {
+  int n = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass && n > poll_alloc) {
+      if (grow(&pollv, n, sizeof(struct pollfd)) || grow(&pollsid, n, sizeof(int))) {
+        return nctl;
+      }
+      poll_alloc = n;
+    }
+    n = 0;
+    if (nctl) {
+      if (pass) {
+        pollv[0] = *ctl;
+        pollsid[0] = -1;
+      }
+      ++n;
+    }
+    if (notifyfd >= 0) {
+      if (pass) {
+        pollv[n].fd = notifyfd;
+        pollv[n].events = POLLIN;
+        pollsid[n] = -2;
+      }
+      ++n;
+    }
+    for (int sid = 0; sid <= sv_max; ++sid) {
+      if (sv.cold[sid].pidfd >= 0) {
+        if (pass) {
+          pollv[n].fd = sv.cold[sid].pidfd;
+          pollv[n].events = POLLIN;
+          pollsid[n] = -3; /* wakes up the main loop to reap it */
+        }
+        ++n;
+      }
+      if (sv.cold[sid].pidfd_standby >= 0) {
+        if (pass) {
+          pollv[n].fd = sv.cold[sid].pidfd_standby;
+          pollv[n].events = POLLIN;
+          pollsid[n] = -3;
+        }
+        ++n;
+      }
+      if (sv.state[sid] != SID_WAITING) {
+        continue;
+      }
+      for (int i = 0; i < sv.cold[sid].nlfd; ++i, ++n) {
+        if (pass) {
+          pollv[n].fd = sv.cold[sid].lfd[i];
+          pollv[n].events = POLLIN;
+          pollsid[n] = sid;
+        }
+      }
+    }
+  }
+  return n;
+}
+
+/* read notifications and start waiting services with a readable fd */
+void pollevents(int n) {
+  for (int i = 0; i < n; ++i) {
+    int sid = pollsid[i];
+    if (sid == -2 && pollv[i].revents) {
+      notify_read();
+    }
+    if (sid < 0 || !pollv[i].revents || sv.state[sid] != SID_WAITING) {
+      continue;
+    }
+    dbg("[%d:%s] wake\n", sid, svname(sid));
+    sv.flags[sid] |= SV_WAKE;
+    state_set(sid, SID_INIT);
+    sv.cold[sid].active_ms = msnow();
+    sv.cold[sid].cpu = 0;
+    circsweep();
+    startservice(sid, 0, sv.cold[sid].sid_father);
+  }
+}
+
+/* return user and system time of pid in clock ticks */
+unsigned long cputime(pid_t pid) {
+  char fn[32] = "/proc/";
+  char buf[512];
+  unsigned long ticks = 0;
+  long len;
+  char *x;
+  fn[6 + fmt_ulong(fn + 6, pid)] = 0;
+  strcat(fn, "/stat");
+  int fd = open(fn, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = 0;
+  if (!(x = strrchr(buf, ')'))) {
+    return 0;
+  }
+  /* utime and stime are the 12th and 13th field after the command */
+  for (int field = 0; *x && field < 13; ++x) {
+    if (*x == ' ' && ++field >= 12) {
+      ticks += strtoul(x + 1, 0, 10);
+    }
+  }
+  return ticks;
+}
+
+/* stop running lazy services which neither used cpu time nor had pending
+ * input on their fds for their idle time, they wait for activity again */
+void idle_check() {
+  unsigned long now = msnow();
+  if (now - idle_checked < IDLE_TICK) {
+    return;
+  }
+  idle_checked = now;
+  idle_watch = 0;
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    sv_t *cold = &sv.cold[sid];
+    if (!(sv.flags[sid] & SV_LAZY) || !cold->idle || !isrunning(sid) || sv.state[sid] != SID_ACTIVE) {
+      continue;
     }
+    idle_watch = 1;
+    unsigned long cpu = cputime(sv.pid[sid]);
+    int pending = 0;
+    for (int i = 0; i < cold->nlfd && !pending; ++i) {
+      struct pollfd p = {cold->lfd[i], POLLIN, 0};
+      pending = poll(&p, 1, 0) > 0;
+    }
+    if (cpu != cold->cpu || pending) {
+      cold->cpu = cpu;
+      cold->active_ms = now;
+    } else if (!(sv.flags[sid] & SV_IDLE) && now - cold->active_ms >= cold->idle) {
+      dbg("[%d:%s] idle\n", sid, svname(sid));
+      sv.flags[sid] |= SV_IDLE;
+      if (!sys.kill(sv.pid[sid], SIGTERM)) {
+        sys.kill(sv.pid[sid], SIGCONT);
+      }
+    }
+  }
+}
+
+void childhandler() {
+  struct rusage ru;
+  pid_t killed = 0;
+  int status = 0;
+  nreaped = 0;
+  do {
+    killed = sys.wait4(-1, &status, WNOHANG, &ru);
+    if (killed != -1) {
+      nreaped += killed > 0;
+      reaped = &ru;
+      handlekilled(killed, status);
+    }
+    // TODO check errno
+  } while (killed && killed != -1);
+  if (subreaper || iam_init) {
+    adopt(0);
+  }
+
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    if (isrunning(sid)) {
+      if (sys.kill(sv.pid[sid], 0)) {
+        handlekilled(sv.pid[sid], 0);
+      } else {
+        killed = 0;
+      }
+    } else if (sv.state[sid] == SID_WAITING || (sv.flags[sid] & SV_QUEUED) ||
+               ((sv.flags[sid] & SV_JOB) && sv.state[sid] == SID_INIT)) {
+      killed = 0;
+    }
+  }
+  if (killed == -1) {
+    if (stop_pending) {
+      stop_step();
+    }
+    if (iam_init) {
+      wout("neoinit: all services exited\n");
+    }
+    if (confdata) {
+      free(confdata);
+    }
+    free(sv.pid);
+    free(sv.state);
+    free(sv.hash);
+    free(sv.name);
     for (int sid = 0; sid <= sv_max; ++sid) {
-      free(svlist[sid].name);
+      free(sv.cold[sid].deps.v);
+      free(sv.cold[sid].rdeps.v);
+      if (!(sv.flags[sid] & SV_INSTANCE)) {
+        free(sv.cold[sid].lfd); /* shared by the instances of a template */
+        free(sv.cold[sid].cpus);
+      }
+      for (int i = 0; i < sv.cold[sid].nstore; ++i) {
+        close(sv.cold[sid].store[i].fd);
+        free(sv.cold[sid].store[i].name);
+      }
+      free(sv.cold[sid].store);
+      free(sv.cold[sid].job);
+    }
+    for (int i = 0; i < njobq; ++i) {
+      free(jobq[i].name);
     }
-    free(svlist);
+    free(jobq);
+    free(mtext);
+    free(sv.flags);
+    free(sv.cold);
+    free(sv_index);
+    free(names);
     exit(0);
   }
 }
 
+/* the state of neoinit for a re-exec is formatted in the metrics text as
+ * records of one letter, space separated numbers and strings as length:bytes,
+ * each ending in a newline:
+ *   v version
+ *   g njobs infd outfd notifyfd
+ *   s name nfields fields...  a service, in the order of the table
+ *   d sid n sids...           its dependencies
+ *   l sid n fds...            listening sockets of a service or template
+ *   c sid n cpus...           CPUs of a template
+ *   f sid fd name             a stored fd
+ *   j sid data                the command of a job
+ *   q name max                a job queue
+ *   h n sids...               the history
+ *   w n sids...               services waiting for the spawn governor
+ * A service record has its number of fields first. A newer neoinit appends
+ * fields, ignores those it does not know and takes defaults for those an
+ * older one did not write. */
+void state_format() {
+  mtext_len = 0;
+  mputs("v ");
+  mputul(STATE_VERSION);
+  mputs("\ng ");
+  mputul(jobs);
+  mputs(" ");
+  mputl(infd);
+  mputs(" ");
+  mputl(outfd);
+  mputs(" ");
+  mputl(notifyfd);
+  mputs("\n");
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    sv_t *c = &sv.cold[sid];
+    long f[STATE_FIELDS] = {sv.pid[sid], sv.state[sid], sv.flags[sid], c->sid_father, c->sid_log,
+                c->changed_at, c->started_ms, c->stop_ms, c->pid_old, c->sid_tmpl,
+                c->instances, c->pid_standby, c->pidfd, c->queue, c->exitcode, c->utime,
+                c->stime, c->maxrss, c->spawns, c->respawns, c->failures, c->respawn_us,
+                c->idle, c->active_ms, c->cpu, c->__stdin, c->__stdout, c->standby_ms,
+                c->standby_quick};
+    mputs("s ");
+    mputul(str_len(svname(sid)));
+    mputs(":");
+    mputs(svname(sid));
+    mputs(" ");
+    mputul(STATE_FIELDS);
+    for (int i = 0; i < STATE_FIELDS; ++i) {
+      mputs(" ");
+      mputl(f[i]);
+    }
+    mputs("\n");
+  }
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    sv_t *c = &sv.cold[sid];
+    struct {
+      char type;
+      int *v;
+      int n;
+    } list[] = {{'d', c->deps.v, c->deps.n}, {'l', c->lfd, c->nlfd}, {'c', c->cpus, c->ncpus}};
+    for (int l = 0; l < 3; ++l) {
+      /* instances share the sockets and CPUs of their template */
+      if (!list[l].n || (l && (sv.flags[sid] & SV_INSTANCE))) {
+        continue;
+      }
+      mput(&list[l].type, 1);
+      mputs(" ");
+      mputul(sid);
+      mputs(" ");
+      mputul(list[l].n);
+      for (int i = 0; i < list[l].n; ++i) {
+        mputs(" ");
+        mputul(list[l].v[i]);
+      }
+      mputs("\n");
+    }
+    for (int i = 0; i < c->nstore; ++i) {
+      mputs("f ");
+      mputul(sid);
+      mputs(" ");
+      mputul(c->store[i].fd);
+      mputs(" ");
+      mputul(str_len(c->store[i].name));
+      mputs(":");
+      mputs(c->store[i].name);
+      mputs("\n");
+    }
+    if (c->job) {
+      mputs("j ");
+      mputul(sid);
+      mputs(" ");
+      mputul(c->joblen);
+      mputs(":");
+      mput(c->job, c->joblen);
+      mputs("\n");
+    }
+  }
+  for (int q = 0; q < njobq; ++q) {
+    mputs("q ");
+    mputul(str_len(jobq[q].name));
+    mputs(":");
+    mputs(jobq[q].name);
+    mputs(" ");
+    mputul(jobq[q].max);
+    mputs("\n");
+  }
+  mputs("h ");
+  mputul(HISTORY);
+  for (int i = 0; i < HISTORY; ++i) {
+    mputs(" ");
+    mputl(history[i]);
+  }
+  mputs("\nw ");
+  mputul(spawnq_len);
+  for (int i = 0; i < spawnq_len; ++i) {
+    mputs(" ");
+    mputul(spawnq[i]);
+  }
+  mputs("\n");
+}
+
+/* read a number of the state being restored */
+long st_num() {
+  long n = 0;
+  int neg = 0;
+  unsigned char c = 0;
+  while (stp < ste && *stp == ' ') {
+    ++stp;
+  }
+  if (stp < ste && *stp == '-') {
+    neg = 1;
+    ++stp;
+  }
+  while (stp < ste && (c = *stp - '0') < 10) {
+    n = n * 10 + c;
+    ++stp;
+  }
+  return neg ? -n : n;
+}
+
+/* read a string of the state being restored, return its length or -1 */
+long st_str(char **s) {
+  long len = st_num();
+  if (stp >= ste || *stp != ':' || len < 0 || len >= ste - stp) {
+    return -1;
+  }
+  *s = stp + 1;
+  stp += len + 1;
+  return len;
+}
+
+/* read a number that has to be a service of the state */
+int st_sid() {
+  long sid = st_num();
+  return sid >= 0 && sid <= sv_max ? sid : -1;
+}
+
+/* set or clear close on exec of the fds kept over a re-exec */
+void state_fds(int flag) {
+  int fds[] = {infd, outfd, notifyfd};
+  for (int i = 0; i < 3; ++i) {
+    if (fds[i] >= 0) {
+      fcntl(fds[i], F_SETFD, flag);
+    }
+  }
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    sv_t *c = &sv.cold[sid];
+    if (c->__stdin != 0) {
+      fcntl(c->__stdin, F_SETFD, flag);
+    }
+    if (c->__stdout != 1) {
+      fcntl(c->__stdout, F_SETFD, flag);
+    }
+    if (c->pidfd >= 0) {
+      fcntl(c->pidfd, F_SETFD, flag);
+    }
+    for (int i = 0; i < c->nlfd && !(sv.flags[sid] & SV_INSTANCE); ++i) {
+      fcntl(c->lfd[i], F_SETFD, flag);
+    }
+    for (int i = 0; i < c->nstore; ++i) {
+      fcntl(c->store[i].fd, F_SETFD, flag);
+    }
+  }
+}
+
+/* restore the state written by state_format to fd, return nonzero on error */
+int state_restore(int fd) {
+  char *data = 0;
+  long len = lseek(fd, 0, SEEK_END);
+  int ret = -1;
+  int g[4] = {0, -1, -1, -1};
+  if (len <= 0 || lseek(fd, 0, SEEK_SET) || !(data = (char *)malloc(len)) ||
+      read(fd, data, len) != len) {
+    goto out;
+  }
+  stp = data;
+  ste = data + len;
+  while (stp < ste) {
+    char type = *stp++;
+    char *x = 0;
+    long n = 0;
+    int sid = -1;
+    switch (type) {
+    case 'v':
+      if (st_num() != STATE_VERSION) {
+        goto out;
+      }
+      break;
+    case 'g':
+      for (int i = 0; i < 4; ++i) {
+        g[i] = st_num();
+      }
+      break;
+    case 's': {
+      sv_t cold;
+      /* defaults of the fields an older neoinit did not write */
+      long f[STATE_FIELDS] = {0, SID_INIT, 0, -1, -1};
+      f[12] = f[14] = -1;
+      f[26] = 1;
+      memset(&cold, 0, sizeof(sv_t));
+      if ((n = st_str(&x)) <= 0) {
+        goto out;
+      }
+      char *name = (char *)alloca(n + 1);
+      memcpy(name, x, n);
+      name[n] = 0;
+      n = st_num();
+      for (int i = 0; i < n; ++i) {
+        long v = st_num();
+        if (i < STATE_FIELDS) {
+          f[i] = v;
+        }
+      }
+      if (n < 3 || (sid = addsv(name, f[2], &cold)) < 0) {
+        goto out;
+      }
+      sv.pid[sid] = f[0];
+      sv.state[sid] = f[1];
+      sv_t *c = &sv.cold[sid];
+      c->sid_father = f[3];
+      c->sid_log = f[4];
+      c->changed_at = f[5];
+      c->started_ms = f[6];
+      c->stop_ms = f[7];
+      c->pid_old = f[8];
+      c->sid_tmpl = f[9];
+      c->instances = f[10];
+      c->pid_standby = f[11];
+      c->pidfd = f[12];
+      c->queue = f[13];
+      c->exitcode = f[14];
+      c->utime = f[15];
+      c->stime = f[16];
+      c->maxrss = f[17];
+      c->spawns = f[18];
+      c->respawns = f[19];
+      c->failures = f[20];
+      c->respawn_us = f[21];
+      c->idle = f[22];
+      c->active_ms = f[23];
+      c->cpu = f[24];
+      c->__stdin = f[25];
+      c->__stdout = f[26];
+      c->standby_ms = f[27];
+      c->standby_quick = f[28];
+      c->pidfd_standby = -1; /* closed by the exec, the exit is noticed later */
+      break;
+    }
+    case 'd':
+    case 'l':
+    case 'c': {
+      if ((sid = st_sid()) < 0 || (n = st_num()) < 0) {
+        goto out;
+      }
+      int *v = type == 'd' ? 0 : (int *)malloc(n * sizeof(int));
+      if (type != 'd' && !v) {
+        goto out;
+      }
+      for (int i = 0; i < n; ++i) {
+        if (type == 'd') {
+          int dep = st_sid();
+          if (dep >= 0) {
+            adddep(sid, dep);
+          }
+        } else {
+          v[i] = st_num();
+        }
+      }
+      if (type == 'l') {
+        sv.cold[sid].lfd = v;
+        sv.cold[sid].nlfd = n;
+      } else if (type == 'c') {
+        sv.cold[sid].cpus = v;
+        sv.cold[sid].ncpus = n;
+      }
+      break;
+    }
+    case 'f': {
+      sv_t *c = 0;
+      if ((sid = st_sid()) < 0) {
+        goto out;
+      }
+      c = &sv.cold[sid];
+      int sfd = st_num();
+      if ((n = st_str(&x)) < 0 || grow(&c->store, c->nstore + 1, sizeof(fdstore_t)) ||
+          !(c->store[c->nstore].name = strndup(x, n))) {
+        goto out;
+      }
+      c->store[c->nstore++].fd = sfd;
+      break;
+    }
+    case 'j':
+      if ((sid = st_sid()) < 0 || (n = st_str(&x)) < 0 ||
+          !(sv.cold[sid].job = (char *)malloc(n + 1))) {
+        goto out;
+      }
+      memcpy(sv.cold[sid].job, x, n);
+      sv.cold[sid].job[n] = 0;
+      sv.cold[sid].joblen = n;
+      break;
+    case 'q':
+      if ((n = st_str(&x)) <= 0 || grow(&jobq, njobq + 1, sizeof(jobq_t)) ||
+          !(jobq[njobq].name = strndup(x, n))) {
+        goto out;
+      }
+      jobq[njobq++].max = st_num();
+      break;
+    case 'h':
+      n = st_num();
+      for (int i = 0; i < n; ++i) {
+        long h = st_num();
+        if (i < HISTORY) {
+          history[i] = h >= 0 && h <= sv_max ? h : -1;
+        }
+      }
+      break;
+    case 'w':
+      n = st_num();
+      for (int i = 0; i < n; ++i) {
+        if ((sid = st_sid()) >= 0) {
+          int setup = sv.flags[sid] & SV_QSETUP;
+          sv.flags[sid] &= ~(SV_QUEUED | SV_QSETUP);
+          if (spawn_defer(sid, setup)) {
+            goto out;
+          }
+        }
+      }
+      break;
+    default:
+      goto out;
+    }
+    if (stp >= ste || *stp++ != '\n') {
+      goto out;
+    }
+  }
+  for (int sid = 0; sid <= sv_max; ++sid) {
+    sv_t *c = &sv.cold[sid];
+    if (sv.flags[sid] & SV_INSTANCE) {
+      c->lfd = sv.cold[c->sid_tmpl].lfd;
+      c->nlfd = sv.cold[c->sid_tmpl].nlfd;
+      c->cpus = sv.cold[c->sid_tmpl].cpus;
+      c->ncpus = sv.cold[c->sid_tmpl].ncpus;
+    }
+  }
+  jobs = g[0];
+  infd = g[1];
+  outfd = g[2];
+  notifyfd = g[3];
+  state_fds(FD_CLOEXEC);
+  dbg("[neoinit] restored %d services\n", sv_max + 1);
+  ret = 0;
+out:
+  free(data);
+  close(fd);
+  return ret;
+}
+
+/* pass the state in a memfd to neoinit executed again, returns on error */
+void reexec() {
+  static char env[11 + FMT_ULONG] = "NEO_STATE=";
+  if (stop_pending || restart_sid >= 0 || !neo_argv) {
+    return;
+  }
+  int fd = memfd_create("neoinit-state", 0);
+  if (fd < 0) {
+    return;
+  }
+  state_format();
+  if (write(fd, mtext, mtext_len) != mtext_len) {
+    close(fd);
+    return;
+  }
+  env[10 + fmt_ulong(env + 10, fd)] = 0;
+  putenv(env);
+  dbg("[neoinit] re-exec\n");
+  state_fds(0);
+  execvp(neo_argv[0], neo_argv);
+  state_fds(FD_CLOEXEC);
+  unsetenv("NEO_STATE");
+  close(fd);
+  werr("neoinit: re-exec failed\n");
+}
+
+/* handle the control request of len bytes read into buf of BUFSIZE + 1,
+ * reply on the out fifo unless the reply is deferred */
+void control(char *buf, long len) {
+  unsigned long t0 = usnow();
+  int sid = -1;
+  reply_begin();
+  char op = len > 0 ? buf[0] : 0;
+  if (len > 1) {
+    buf[len] = 0;
+    if (buf[0] != 's' && buf[0] != 'N' && buf[0] != 'J' && ((sid = findservice(buf + 1)) < 0) &&
+        strcmp(buf, "d-") != 0) {
+    error:
+      write_checked(outfd, "0", 1);
+    } else {
+      switch (buf[0]) {
+      case 'p': // get service pid and state
+        len = fmt_long(buf, sv.pid[sid]);
+        buf[len++] = '@';
+        len += fmt_ulong(buf + len, sv.state[sid]);
+        buf[len++] = 0;
+        write_checked(outfd, buf, len);
+        break;
+      case 'r': // unset service respawn
+        sv.flags[sid] &= ~SV_RESPAWN;
+        goto ok;
+      case 'R': // set service respawn
+        sv.flags[sid] |= SV_RESPAWN;
+        goto ok;
+      case 'S': // stop service and its dependencies, reply when down
+      case 'A': // stop all but this service, reply when down
+        if (stop_pending || restart_sid >= 0 || stop_begin(sid, buf[0] == 'A')) {
+          goto error;
+        }
+        stop_step();
+        break;
+      case 'x': // restart service, reply when the previous instance is down
+        if (stop_pending || restart_sid >= 0) {
+          goto error;
+        }
+        if (!isrunning(sid)) {
+          goto start;
+        }
+        if (restart_begin(sid)) {
+          goto error;
+        }
+        break;
+      case 'c': // cancel service (prepare to stop)
+        if (!isrunning(sid)) {
+          goto error;
+        }
+        dbg("[%d:%s] STOPPED\n", sid, svname(sid));
+        state_set(sid, SID_STOPPED);
+        goto ok;
+      case 'C': // clear service (reset state)
+        if (sv.pid[sid] != PID_DOWN) {
+          goto error;
+        }
+        dbg("[%d:%s] INIT\n", sid, svname(sid));
+        state_set(sid, SID_INIT);
+        sv.cold[sid].changed_at = sys.time(0);
+        goto ok;
+      case 'P': { // set service pid
+        char *x = buf + str_len(buf) + 1;
+        unsigned char c = 0;
+        pid_t pid = 0;
+        while ((c = *x++ - '0') < 10) {
+          pid = pid * 10 + c;
+        }
+        if (pid > 0) {
+          if (sys.kill(pid, 0)) {
+            goto error;
+          }
+        }
+        dbg("[%d:%s] set PID\n", sid, svname(sid));
+        dbg("[%d:%s] pid %d\n", sid, svname(sid), pid);
+        if (sv.state[sid] != SID_ACTIVE) {
+          dbg("[%d:%s] ACTIVE\n", sid, svname(sid));
+          state_set(sid, SID_ACTIVE);
+        }
+        sv.cold[sid].changed_at = sys.time(0);
+        sv.pid[sid] = pid;
+        goto ok;
+      }
+      case 'N': { // set number of instances of a template
+        char *x = buf + str_len(buf) + 1;
+        unsigned char c = 0;
+        int n = 0;
+        while ((c = *x++ - '0') < 10) {
+          n = n * 10 + c;
+        }
+        if ((sid = loadservice(buf + 1)) < 0 || !(sv.flags[sid] & SV_TEMPLATE)) {
+          goto error;
+        }
+        sv.cold[sid].instances = n;
+        if (sv.state[sid] == SID_ACTIVE) {
+          circsweep();
+          scale(sid, 0);
+        }
+        goto ok;
+      }
+      case 'J': { // submit a job, reply with its name
+        char *x = buf + str_len(buf) + 1;
+        if (x >= buf + len || (sid = job_submit(buf + 1, x, buf + len - x)) < 0) {
+          goto error;
+        }
+        jobs_drain();
+        buf[0] = '1';
+        strcpy(buf + 1, svname(sid));
+        write_checked(outfd, buf, str_len(buf));
+        break;
+      }
+      case 'j': { // get exit code and resource usage of the last run
+        sv_t *cold = &sv.cold[sid];
+        len = fmt_ulong(buf, sv.state[sid]);
+        buf[len++] = ' ';
+        len += fmt_long(buf + len, cold->exitcode);
+        buf[len++] = ' ';
+        len += fmt_ulong(buf + len, cold->utime);
+        buf[len++] = ' ';
+        len += fmt_ulong(buf + len, cold->stime);
+        buf[len++] = ' ';
+        len += fmt_long(buf + len, cold->maxrss);
+        write_checked(outfd, buf, len);
+        break;
+      }
+      case 's': // start service
+      start:
+        sid = loadservice(buf + 1);
+        if (sid < 0) {
+          goto error;
+        }
+        if (!isrunning(sid)) {
+          dbg("[%d:%s] INIT\n", sid, svname(sid));
+          state_set(sid, SID_INIT);
+          sv.cold[sid].changed_at = sys.time(0);
+          circsweep();
+          if (startservice(sid, 0, -1)) {
+            goto error;
+          }
+        }
+      ok:
+        write_checked(outfd, "1", 1);
+        break;
+      case 'u': // get service uptime
+        write_checked(outfd, buf, fmt_ulong(buf, sys.time(0) - sv.cold[sid].changed_at));
+        break;
+      case 'd': // get service dependencies
+      case 'e': { // get dependent services
+        edges_t *e = 0;
+        len = 0;
+        write_checked(outfd, "1:", 2);
+        if (sid >= 0) {
+          e = buf[0] == 'd' ? &sv.cold[sid].deps : &sv.cold[sid].rdeps;
+          for (int i = 0; i < e->n; ++i) {
+            write_checked(outfd, svname(e->v[i]), str_len(svname(e->v[i])) + 1);
+          }
+          len = e->n;
+        } else { // services no other service depends on
+          for (int si = 0; si <= sv_max; ++si) {
+            if (isup(si) && !sv.cold[si].rdeps.n) {
+              write_checked(outfd, svname(si), str_len(svname(si)) + 1);
+              len = 1;
+            }
+          }
+        }
+        if (!len) {
+          write_checked(outfd, "\0\0", 2);
+        } else {
+          write_checked(outfd, "\0", 1);
+        }
+        break;
+      }
+      }
+    }
+  } else {
+    if (buf[0] == 'A') { // stop all services, reply when down
+      if (stop_pending || restart_sid >= 0 || stop_begin(-1, 1)) {
+        write_checked(outfd, "0", 1);
+      } else {
+        stop_step();
+      }
+    } else if (buf[0] == 'h') { // get service history
+      write_checked(outfd, "1:", 2);
+      for (int i = 0; i < HISTORY; ++i) {
+        if (history[i] != -1) {
+          write_checked(outfd, svname(history[i]), str_len(svname(history[i])) + 1);
+        }
+      }
+      write_checked(outfd, "\0", 1);
+    } else if (buf[0] == 'T') { // dump the trace ring
+      trace_dump();
+    } else if (buf[0] == 'M') { // get metrics
+      metrics_dump();
+    } else if (buf[0] == 'X') { // re-execute neoinit, the new one replies
+      reexec();
+      write_checked(outfd, "0", 1);
+    } else if (buf[0] == 'l' || buf[0] == 'L') { // get service list
+      write_checked(outfd, "1:", 2);
+      for (int si = 0; si <= sv_max; ++si) {
+        write_checked(outfd, svname(si), str_len(svname(si)));
+        if (buf[0] == 'l') {
+          write_checked(outfd, "\0", 1);
+          continue;
+        }
+        write_checked(outfd, " ", 1);
+        write_checked(outfd, buf, fmt_state(buf, sv.state[si]));
+        write_checked(outfd, " ", 1);
+        write_checked(outfd, buf, fmt_ulong(buf, sys.time(0) - sv.cold[si].changed_at));
+        write_checked(outfd, "s\0", 2);
+      }
+      write_checked(outfd, "\0", 1);
+    }
+  }
+  if (op) {
+    unsigned long us = usnow() - t0;
+    trace(TR_CTL, sid, op, us);
+    /* opcodes are letters, other bytes would not be valid in the op label */
+    if ((op >= 'a' && op <= 'z') || (op >= 'A' && op <= 'Z')) {
+      hist_add(&ctl_hist[(int)op], us);
+      metrics_dirty = 1;
+    }
+  }
+}
+
+/* the work of a main loop iteration before it waits for events, returns
+ * the time to wait in ms */
+int loop_step() {
+  reply_begin();
+  childhandler();
+  if (spawnq_len) {
+    spawn_drain();
+  }
+  if (njobq) {
+    jobs_drain();
+  }
+  if (stop_pending) {
+    stop_step();
+  }
+  if (restart_sid >= 0) {
+    restart_step();
+  }
+  idle_check();
+  if (ra_enabled) {
+    ra_sample();
+    /* written once, services started later are not part of the boot */
+    if (ra_dirty && !spawnq_len && msnow() - ra_added >= RA_SETTLE) {
+      ra_save();
+      ra_enabled = 0;
+    }
+  }
+  metrics_save();
+  return spawnq_len || stop_pending || restart_sid >= 0 ? TICK
+         : idle_watch                                  ? IDLE_TICK
+         : metrics_path && metrics_dirty               ? METRICS_INTERVAL
+                                                       : 5000;
+}
+
 int main(int argc, char *argv[]) {
   struct pollfd pfd;
-  time_t last = time(0);
+  time_t last = sys.time(0);
   int nfds = 1;
 
   for (int i = 0; i < HISTORY; ++i) {
@@ -532,13 +3420,40 @@ int main(int argc, char *argv[]) {
   if (getpid() == 1) {
     iam_init = 1;
     reboot(0);
+  } else if (!prctl(PR_SET_CHILD_SUBREAPER, 1)) {
+    subreaper = 1;
   }
 
-  circsweep();
-  startservice(loadservice("boot"), 0, -1);
+  /* a path to execute neoinit again, the working directory changes */
+  neo_argv = argv;
+  if (strchr(argv[0], '/') && argv[0][0] != '/') {
+    char *exe = realpath(argv[0], 0);
+    if (exe) {
+      argv[0] = exe;
+    }
+  }
+
+  char *state = getenv("NEO_STATE");
+  int reexeced = state != 0;
+  int restored = 0;
+  if (reexeced) {
+    restored = !state_restore(atoi(state));
+    unsetenv("NEO_STATE");
+    if (!restored) {
+      werr("neoinit: could not restore the state\n");
+    }
+  }
+
+  if (!restored) {
+    ra_boot();
+    notify_open();
 
-  infd = open(NEOROOT "/in", O_RDWR | O_CLOEXEC);
-  outfd = open(NEOROOT "/out", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    circsweep();
+    startservice(loadservice("boot"), 0, -1);
+
+    infd = open(NEOROOT "/in", O_RDWR | O_CLOEXEC);
+    outfd = open(NEOROOT "/out", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  }
 
   if (infd < 0 || outfd < 0) {
     werr("neoinit: could not open " NEOROOT "/{in,out}\n");
@@ -555,7 +3470,7 @@ int main(int argc, char *argv[]) {
 
   unsigned long len = 0;
   char **conf = 0;
-  if (!openreadclose(NEOROOT "/neo.conf", &confdata, &len)) {
+  if (!sys.openreadclose(NEOROOT "/neo.conf", &confdata, &len)) {
     len = 0;
     conf = split(confdata, '\n', &len, 0, 0);
     if (conf) {
@@ -567,33 +3482,47 @@ int main(int argc, char *argv[]) {
       free(conf);
     }
   }
+  spawn_config();
+  metrics_path = getenv("NEO_METRICS");
 
   int count = 0;
-  for (int i = 1; i < argc; i++) {
+  for (int i = 1; i < argc && !restored; i++) {
     circsweep();
     if (startservice(loadservice(argv[i]), 0, -1)) {
       count++;
     }
   }
   circsweep();
-  if (!count) {
+  if (!count && !restored) {
     startservice(loadservice("default"), 0, -1);
   }
+  if (reexeced) {
+    write_checked(outfd, restored ? "1" : "0", 1); /* reply to the re-exec request */
+  }
 
+  unsigned long busy = usnow();
   for (;;) {
     char buf[BUFSIZE + 1];
     time_t now = 0;
-    childhandler();
-    now = time(0);
+    int wait = loop_step();
+    now = sys.time(0);
     if (now < last || now - last > 30) {
       /* the system clock was reset, compensate */
       long diff = last - now;
       for (int j = 0; j <= sv_max; ++j) {
-        svlist[j].changed_at -= diff;
+        sv.cold[j].changed_at -= diff;
       }
     }
     last = now;
-    switch (poll(&pfd, nfds, 5000)) {
+    int npoll = pollset(&pfd, nfds);
+    hist_add(&loop_hist, usnow() - busy);
+    int ready = poll(pollv ? pollv : &pfd, npoll, wait);
+    busy = usnow();
+    if (ready > 0 && npoll > nfds) {
+      pollevents(npoll);
+      ready = nfds && (pollv[0].revents & POLLIN);
+    }
+    switch (ready) {
     case -1:
       if (errno == EINTR) {
         childhandler();
@@ -601,131 +3530,14 @@ int main(int argc, char *argv[]) {
       }
       werr("neoinit: poll failed!\n");
       break;
-    case 1:
-      len = read(infd, buf, BUFSIZE);
-      if (len > 1) {
-        int sid = -1;
-        buf[len] = 0;
-        if (buf[0] != 's' && ((sid = findservice(buf + 1)) < 0) && strcmp(buf, "d-") != 0) {
-        error:
-          write_checked(outfd, "0", 1);
-        } else {
-          switch (buf[0]) {
-          case 'p': // get service pid and state
-            len = fmt_long(buf, svlist[sid].pid);
-            buf[len++] = '@';
-            len += fmt_ulong(buf + len, svlist[sid].state);
-            buf[len++] = 0;
-            write_checked(outfd, buf, len);
-            break;
-          case 'r': // unset service respawn
-            svlist[sid].respawn = 0;
-            goto ok;
-          case 'R': // set service respawn
-            svlist[sid].respawn = 1;
-            goto ok;
-          case 'c': // cancel service (prepare to stop)
-            if (!isrunning(sid)) {
-              goto error;
-            }
-            dbg("[%d:%s] STOPPED\n", sid, svlist[sid].name);
-            svlist[sid].state = SID_STOPPED;
-            goto ok;
-          case 'C': // clear service (reset state)
-            if (svlist[sid].pid != PID_DOWN) {
-              goto error;
-            }
-            dbg("[%d:%s] INIT\n", sid, svlist[sid].name);
-            svlist[sid].state = SID_INIT;
-            svlist[sid].changed_at = time(0);
-            goto ok;
-          case 'P': { // set service pid
-            char *x = buf + str_len(buf) + 1;
-            unsigned char c = 0;
-            pid_t pid = 0;
-            while ((c = *x++ - '0') < 10) {
-              pid = pid * 10 + c;
-            }
-            if (pid > 0) {
-              if (kill(pid, 0)) {
-                goto error;
-              }
-            }
-            dbg("[%d:%s] set PID\n", sid, svlist[sid].name);
-            dbg("[%d:%s] pid %d\n", sid, svlist[sid].name, pid);
-            if (svlist[sid].state != SID_ACTIVE) {
-              dbg("[%d:%s] ACTIVE\n", sid, svlist[sid].name);
-              svlist[sid].state = SID_ACTIVE;
-            }
-            svlist[sid].changed_at = time(0);
-            svlist[sid].pid = pid;
-            goto ok;
-          }
-          case 's': // start service
-            sid = loadservice(buf + 1);
-            if (sid < 0) {
-              goto error;
-            }
-            if (!isrunning(sid)) {
-              dbg("[%d:%s] INIT\n", sid, svlist[sid].name);
-              svlist[sid].state = SID_INIT;
-              svlist[sid].changed_at = time(0);
-              circsweep();
-              if (startservice(sid, 0, -1)) {
-                goto error;
-              }
-            }
-          ok:
-            write_checked(outfd, "1", 1);
-            break;
-          case 'u': // get service uptime
-            write_checked(outfd, buf, fmt_ulong(buf, time(0) - svlist[sid].changed_at));
-            break;
-          case 'd': // get service dependencies
-            len = 0;
-            write_checked(outfd, "1:", 2);
-            dbg("[neoinit] looking for father = sid %d\n", sid);
-            for (int si = 0; si <= sv_max; ++si) {
-              if (svlist[si].sid_father == sid) {
-                write_checked(outfd, svlist[si].name, str_len(svlist[si].name) + 1);
-                len = 1;
-              }
-            }
-            if (!len) {
-              write_checked(outfd, "\0\0", 2);
-            } else {
-              write_checked(outfd, "\0", 1);
-            }
-            break;
-          }
-        }
-      } else {
-        if (buf[0] == 'h') { // get service history
-          write_checked(outfd, "1:", 2);
-          for (int i = 0; i < HISTORY; ++i) {
-            if (history[i] != -1) {
-              write_checked(outfd, svlist[history[i]].name, str_len(svlist[history[i]].name) + 1);
-            }
-          }
-          write_checked(outfd, "\0", 1);
-        } else if (buf[0] == 'l' || buf[0] == 'L') { // get service list
-          write_checked(outfd, "1:", 2);
-          for (int si = 0; si <= sv_max; ++si) {
-            write_checked(outfd, svlist[si].name, str_len(svlist[si].name));
-            if (buf[0] == 'l') {
-              write_checked(outfd, "\0", 1);
-              continue;
-            }
-            write_checked(outfd, " ", 1);
-            write_checked(outfd, buf, fmt_state(buf, svlist[si].state));
-            write_checked(outfd, " ", 1);
-            write_checked(outfd, buf, fmt_ulong(buf, time(0) - svlist[si].changed_at));
-            write_checked(outfd, "s\0", 2);
-          }
-          write_checked(outfd, "\0", 1);
-        }
+    case 1: {
+      long n = read(infd, buf, BUFSIZE);
+      if (!ioctl(infd, FIONREAD, &ctl_queued) && ctl_queued > ctl_queued_max) {
+        ctl_queued_max = ctl_queued;
       }
+      control(buf, n);
       break;
+    }
     default:
       break;
     }
@@ -15,6 +15,7 @@
 #define SID_FAILED   4
 #define SID_SETUP    5
 #define SID_CANCELED 6
+#define SID_WAITING  7
 
 #define FMT_STATE 8 // str_len("canceled")
 
@@ -41,6 +42,9 @@ size_t fmt_state(char *buf, int state) {
   case SID_CANCELED:
     strcpy(buf, "canceled");
     break;
+  case SID_WAITING:
+    strcpy(buf, "waiting");
+    break;
   default:
     strcpy(buf, "invalid");
     buf = "invalid";
@@ -1,8 +1,13 @@
+#include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "djb/errmsg.h"
@@ -11,6 +16,8 @@
 
 #include "neoinit.h"
 
+#define NOTIFY_TIMEOUT 5000 /* ms to wait for neoinit to acknowledge a notification */
+
 static int infd, outfd;
 
 static char buf[BUFSIZE + 1];
@@ -91,6 +98,20 @@ int setpid(char *service, pid_t pid) {
   return (len != 1 || buf[0] == '0');
 }
 
+/* set the number of instances of a template, return nonzero if error */
+int setinstances(char *service, unsigned long n) {
+  buf[0] = 'N';
+  int buf_len = addservice(service);
+  if (buf_len + 10 > BUFSIZE) {
+    return 1;
+  }
+  char *tmp = buf + buf_len + 1;
+  tmp[fmt_ulong(tmp, n)] = 0;
+  write_checked(infd, buf, buf_len + str_len(tmp) + 2);
+  int len = read(outfd, buf, BUFSIZE);
+  return (len != 1 || buf[0] == '0');
+}
+
 /* return nonzero if error */
 int clear(char *service) {
   buf[0] = 'C';
@@ -105,6 +126,163 @@ int startservice(char *service) {
   return (len != 1 || buf[0] == '0');
 }
 
+/* stop service and its dependencies, return nonzero if error */
+int stopservice(char *service) {
+  buf[0] = 'S';
+  int len = addreadwrite(service);
+  return (len != 1 || buf[0] == '0');
+}
+
+/* stop all services but the calling one, return nonzero if error */
+int stopall() {
+  char *self = getenv("NEO_SERVICE");
+  int len = 0;
+  buf[0] = 'A';
+  if (self) {
+    len = addreadwrite(self);
+  } else {
+    write_checked(infd, buf, 1);
+    len = read(outfd, buf, BUFSIZE);
+  }
+  return (len != 1 || buf[0] == '0');
+}
+
+/* execute neoinit again keeping its state, return nonzero if error */
+int reexec() {
+  buf[0] = 'X';
+  write_checked(infd, buf, 1);
+  return read(outfd, buf, BUFSIZE) != 1 || buf[0] != '1';
+}
+
+/* send msg for the calling service to neoinit, with fd attached unless -1,
+ * return nonzero if error */
+int notify(char *msg, int fd) {
+  char *sock = getenv("NOTIFY_SOCKET");
+  char *self = getenv("NEO_SERVICE");
+  struct sockaddr_un sa;
+  char msgbuf[BUFSIZE];
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov;
+  struct msghdr mh;
+  unsigned long len;
+  int s;
+  if (!sock || !self || (len = str_len(sock)) >= sizeof(sa.sun_path) ||
+      str_len(msg) + str_len(self) + 10 > sizeof(msgbuf)) {
+    return 1;
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  memcpy(sa.sun_path, sock, len);
+  if (sa.sun_path[0] == '@') {
+    sa.sun_path[0] = 0; /* abstract socket */
+  }
+  strcpy(msgbuf, msg);
+  strcat(msgbuf, "\nSERVICE=");
+  strcat(msgbuf, self);
+  iov.iov_base = msgbuf;
+  iov.iov_len = str_len(msgbuf);
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = &sa;
+  mh.msg_namelen = offsetof(struct sockaddr_un, sun_path) + len;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    struct cmsghdr *c;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    c = CMSG_FIRSTHDR(&mh);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+  if ((s = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    return 1;
+  }
+  /* bind to an autogenerated name, neoinit acknowledges to it once the
+   * message is handled, so it is even if the service exits right away */
+  sa_family_t family = AF_UNIX;
+  struct pollfd pfd = {s, POLLIN, 0};
+  char ack = '0';
+  if (bind(s, (struct sockaddr *)&family, sizeof(family)) || sendmsg(s, &mh, 0) < 0 ||
+      poll(&pfd, 1, NOTIFY_TIMEOUT) != 1 || read(s, &ack, 1) != 1) {
+    ack = '0';
+  }
+  close(s);
+  return ack != '1';
+}
+
+/* store fd with neoinit under name for the next run of the calling service,
+ * remove the fds stored under name if fd is -1. return nonzero if error */
+int storefd(char *name, int fd) {
+  char *msg = (char *)alloca(str_len(name) + 32);
+  strcpy(msg, fd < 0 ? "FDSTOREREMOVE=1\nFDNAME=" : "FDSTORE=1\nFDNAME=");
+  strcat(msg, name);
+  return notify(msg, fd);
+}
+
+/* restart service, return nonzero if error */
+int restart(char *service) {
+  buf[0] = 'x';
+  int len = addreadwrite(service);
+  return (len != 1 || buf[0] == '0');
+}
+
+/* submit a job of VAR=val items and a command line to queue (name[:max]),
+ * print its name, return nonzero if error */
+int submitjob(char *queue, int argc, char **argv) {
+  unsigned long len = str_len(queue) + 2;
+  for (int i = 0; i < argc; ++i) {
+    len += str_len(argv[i]) + 1;
+  }
+  if (len > BUFSIZE) {
+    return 1;
+  }
+  buf[0] = 'J';
+  len = 1;
+  for (int i = -1; i < argc; ++i) {
+    char *x = i < 0 ? queue : argv[i];
+    strcpy(buf + len, x);
+    len += str_len(x) + 1;
+  }
+  write_checked(infd, buf, len);
+  int n = read(outfd, buf, BUFSIZE);
+  if (n < 2 || buf[0] != '1') {
+    return 1;
+  }
+  buf[n] = 0;
+  msg(buf + 1);
+  return 0;
+}
+
+/* print state, exit code and resource usage of the last run of a job or
+ * service, return nonzero if error */
+int jobstatus(char *service) {
+  char which[FMT_STATE + 1];
+  char *field[5];
+  buf[0] = 'j';
+  int len = addreadwrite(service);
+  if (len < 2) {
+    return 1;
+  }
+  buf[len] = 0;
+  field[0] = buf;
+  for (int i = 1; i < 5; ++i) {
+    field[i] = field[i - 1] + str_chr(field[i - 1], ' ');
+    if (*field[i]) {
+      *field[i]++ = 0;
+    }
+  }
+  which[fmt_state(which, atoi(field[0]))] = 0;
+  if (*field[1] == '-') {
+    msg(service, " ", which);
+  } else {
+    msg(service, " ", which, " exit ", field[1], " user ", field[2], "ms sys ", field[3],
+        "ms maxrss ", field[4], "kB");
+  }
+  return 0;
+}
+
 /* return uptime, 0 if error */
 unsigned long uptime(char *service) {
   buf[0] = 'u';
@@ -163,14 +341,14 @@ void dumpservices(char dump_cmd) {
   }
 }
 
-void dumpdependencies(char *service) {
+void dumpdependencies(char dump_cmd, char *service) {
   char tmp[16384];
   int i = 0;
   int j = 0;
   int done = 0;
   char first = 1;
   char last = 'x';
-  buf[0] = 'd';
+  buf[0] = dump_cmd;
   int buf_len = addservice(service);
   write_checked(infd, buf, buf_len);
   for (;;) {
@@ -226,14 +404,43 @@ int main(int argc, char *argv[]) {
         " -s\tprint the current state of the service\n"
         " -g\tget pid. print just the service PID\n"
         " -C\tclear. reset a finished service\n"
+        " -S\tstop. stop services and dependencies or all, wait until down\n"
+        " -x\trestart. start a new instance, stop the old one when it is ready\n"
+        " -y\tready. report the calling service ready\n"
         " -P pid\tset PID of service\n"
-        " -D\tprint services started as dependency\n"
+        " -N n\tset number of instances of a template service name@\n"
+        " -J queue[:max] [VAR=val]... command\n"
+        "\tsubmit a job to a queue running at most max (default 1) jobs at once\n"
+        " -j\tprint exit code and resource usage of jobs or services\n"
+        " -F name [fd]\tstore fd (default 0, - to remove) for the next run of the service\n"
+        " -D\tprint service dependencies\n"
+        " -E\tprint services depending on service\n"
         " -H\thistory. print last started services\n"
         " -l\tprint all known services\n"
-        " -L\tprint all services and its states");
+        " -L\tprint all services and its states\n"
+        " -T\ttrace. print the last events recorded by neoinit\n"
+        " -M\tmetrics. print counters and latencies of neoinit in Prometheus format\n"
+        " -X\texecute neoinit again keeping its state, to upgrade it");
     return 0;
   }
   // errmsg_iam("neorc");
+  /* notifications go over NOTIFY_SOCKET, they must not wait for the lock
+   * held by a restart waiting for them */
+  if (argv[1][0] == '-' && argv[1][1] == 'y') {
+    if (notify("READY=1", -1)) {
+      carp("could not report ready");
+      return 1;
+    }
+    return 0;
+  }
+  if (argv[1][0] == '-' && argv[1][1] == 'F') {
+    if (argc < 3 || argc > 4 ||
+        storefd(argv[2], argc < 4 ? 0 : strcmp(argv[3], "-") ? atoi(argv[3]) : -1)) {
+      carp("could not store fd ", argc < 3 ? "" : argv[2]);
+      return 1;
+    }
+    return 0;
+  }
   infd = open(NEOROOT "/in", O_WRONLY | O_CLOEXEC);
   outfd = open(NEOROOT "/out", O_RDONLY | O_CLOEXEC);
   if (infd >= 0) {
@@ -241,7 +448,8 @@ int main(int argc, char *argv[]) {
       carp("could not acquire lock");
       sleep(1);
     }
-    if (argc == 2 && argv[1][1] != 'H' && argv[1][1] != 'l' && argv[1][1] != 'L') {
+    if (argc == 2 && argv[1][1] != 'H' && argv[1][1] != 'l' && argv[1][1] != 'L' &&
+        argv[1][1] != 'S' && argv[1][1] != 'T' && argv[1][1] != 'M' && argv[1][1] != 'X') {
       int state = 0;
       pid_t pid = __readpid(argv[1], &state);
       if (buf[0] != '0') {
@@ -359,6 +567,18 @@ int main(int argc, char *argv[]) {
           }
         }
         break;
+      case 'S':
+        if (argc == 2 && stopall()) {
+          carp("could not stop services");
+          ret = 1;
+        }
+        for (int i = 2; i < argc; ++i) {
+          if (stopservice(argv[i])) {
+            carp("could not stop ", argv[i]);
+            ret = 1;
+          }
+        }
+        break;
       case 'P':
         pid = atoi(argv[1] + 2);
         if (pid > 1) {
@@ -368,17 +588,62 @@ int main(int argc, char *argv[]) {
           }
         }
         break;
+      case 'x':
+        for (int i = 2; i < argc; ++i) {
+          if (restart(argv[i])) {
+            carp("could not restart ", argv[i]);
+            ret = 1;
+          }
+        }
+        break;
+      case 'N':
+        for (int i = 2; i < argc; ++i) {
+          if (setinstances(argv[i], atoi(argv[1] + 2))) {
+            carp("could not set instances of ", argv[i]);
+            ret = 1;
+          }
+        }
+        break;
+      case 'J':
+        if (argc < 4 || submitjob(argv[2], argc - 3, argv + 3)) {
+          carp("could not submit job to ", argc < 3 ? "" : argv[2]);
+          ret = 1;
+        }
+        break;
+      case 'j':
+        for (int i = 2; i < argc; ++i) {
+          if (jobstatus(argv[i])) {
+            carp(argv[i], ": no such service");
+            ret = 1;
+          }
+        }
+        break;
       case 'H':
         dumpservices('h');
         break;
       case 'L':
         dumpservices('L');
         break;
+      case 'T':
+        dumpservices('T');
+        break;
+      case 'M':
+        dumpservices('M');
+        break;
+      case 'X':
+        if (reexec()) {
+          carp("could not execute neoinit again");
+          ret = 1;
+        }
+        break;
       case 'l':
         dumpservices('l');
         break;
       case 'D':
-        dumpdependencies(argv[2]);
+        dumpdependencies('d', argv[2]);
+        break;
+      case 'E':
+        dumpdependencies('e', argv[2]);
         break;
       }
     }
@@ -1,23 +1,155 @@
 #include <alloca.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "djb/byte.h"
 #include "djb/errmsg.h"
+#include "djb/fmt.h"
 #include "djb/str.h"
 
 extern char **environ;
 
-#define MAXENV 256
-char *envp[MAXENV + 2];
-int envc;
+char **envp;
+int envc, envalloc;
 
 int continueonerror;
 
+#define MAXJOBS 256
+pid_t jobs[MAXJOBS]; /* background commands still running */
+int njobs;
+int maxjobs = MAXJOBS;
+int jobstatus; /* first failure of a background command since the last wait */
+
+/* timing of every command for -t or SERDO_TRACE */
+typedef struct {
+  char *cmd;
+  unsigned long start, end, cpu; /* ms */
+  int status;
+} trace_t;
+
+int trace;
+char *tracefile;
+trace_t *tr;
+int ntr, tralloc;
+int curtrace = -1;       /* entry of the command being spawned */
+struct rusage spawnru;   /* usage of the last command waited for */
+int jobtrace[MAXJOBS];   /* entries of the background commands */
+
+unsigned long msnow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* start a trace entry for argv, return its index or -1 */
+int trace_begin(char **argv) {
+  int i, len = 0;
+  char *cmd;
+  if (!trace) {
+    return -1;
+  }
+  if (ntr == tralloc) {
+    trace_t *t = (trace_t *)realloc(tr, (tralloc * 2 + 64) * sizeof(trace_t));
+    if (!t) {
+      return -1;
+    }
+    tr = t;
+    tralloc = tralloc * 2 + 64;
+  }
+  for (i = 0; argv[i]; ++i) {
+    len += str_len(argv[i]) + 1;
+  }
+  if (!(cmd = (char *)malloc(len + 1))) {
+    return -1;
+  }
+  for (i = 0, len = 0; argv[i]; ++i) {
+    len += str_copy(cmd + len, argv[i]);
+    cmd[len++] = ' ';
+  }
+  cmd[len ? len - 1 : 0] = 0;
+  tr[ntr].cmd = cmd;
+  tr[ntr].start = msnow();
+  tr[ntr].end = tr[ntr].start;
+  tr[ntr].cpu = 0;
+  tr[ntr].status = 0;
+  return ntr++;
+}
+
+void trace_end(int t, int status, struct rusage *ru) {
+  if (t < 0) {
+    return;
+  }
+  tr[t].end = msnow();
+  tr[t].status = status;
+  tr[t].cpu = ru->ru_utime.tv_sec * 1000 + ru->ru_utime.tv_usec / 1000 +
+              ru->ru_stime.tv_sec * 1000 + ru->ru_stime.tv_usec / 1000;
+}
+
+/* right align number n in a column of width */
+int fmt_col(char *dest, long n, int width) {
+  char num[FMT_LONG];
+  int i, len = fmt_long(num, n);
+  for (i = 0; i < width - len; ++i) {
+    dest[i] = ' ';
+  }
+  byte_copy(dest + i, len, num);
+  return i + len;
+}
+
+/* write start offset, elapsed, cpu time (ms) and exit status of every command */
+void trace_report() {
+  static const char head[] = "   start    time     cpu exit command\n";
+  unsigned long max = 0;
+  int fd = 2;
+  char *buf;
+  if (!ntr) {
+    return;
+  }
+  for (int i = 0; i < ntr; ++i) {
+    if (str_len(tr[i].cmd) > max) {
+      max = str_len(tr[i].cmd);
+    }
+  }
+  if (!(buf = (char *)malloc(4 * 10 + max + 2))) {
+    carp("out of memory");
+    return;
+  }
+  if (tracefile && *tracefile && (fd = open(tracefile, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+    carpsys("could not open ", tracefile);
+    free(buf);
+    return;
+  }
+  if (write(fd, head, sizeof head - 1) < 0) {
+    ntr = 0;
+  }
+  for (int i = 0; i < ntr; ++i) {
+    int len = fmt_col(buf, tr[i].start - tr[0].start, 8);
+    len += fmt_col(buf + len, tr[i].end - tr[i].start, 8);
+    len += fmt_col(buf + len, tr[i].cpu, 8);
+    len += fmt_col(buf + len, tr[i].status, 5);
+    buf[len++] = ' ';
+    len += str_copy(buf + len, tr[i].cmd);
+    buf[len++] = '\n';
+    if (write(fd, buf, len) < 0) {
+      break;
+    }
+  }
+  free(buf);
+  if (fd != 2) {
+    close(fd);
+  }
+}
+
 int envset(char *s) {
   int i, l;
   if (s[l = str_chr(s, '=')] != '=') {
@@ -30,15 +162,312 @@ int envset(char *s) {
       return 0;
     }
   }
-  if (envc < MAXENV) {
-    envp[envc] = s;
-    envp[++envc] = 0;
-    return 0;
+  if (envc + 1 >= envalloc) {
+    char **e = (char **)realloc(envp, (envalloc * 2 + 64) * sizeof(char *));
+    if (!e) {
+      return -1;
+    }
+    envp = e;
+    envalloc = envalloc * 2 + 64;
+  }
+  envp[envc] = s;
+  envp[++envc] = 0;
+  return 0;
+}
+
+/* builtins return NOBUILTIN for arguments they do not handle,
+ * the command is executed then */
+#define NOBUILTIN -2
+
+int b_mkdir(char **argv) {
+  int parents = 0;
+  if (argv[1] && str_equal(argv[1], "-p")) {
+    parents = 1;
+    ++argv;
+  }
+  if (!argv[1] || argv[1][0] == '-') {
+    return NOBUILTIN;
+  }
+  while (*++argv) {
+    char *s = *argv;
+    if (parents) {
+      for (char *x = s + 1; *x; ++x) {
+        if (*x == '/') {
+          *x = 0;
+          mkdir(s, 0777);
+          *x = '/';
+        }
+      }
+    }
+    if (mkdir(s, 0777) == -1) {
+      struct stat ss;
+      if (!parents || errno != EEXIST || stat(s, &ss) == -1 || !S_ISDIR(ss.st_mode)) {
+        carpsys("could not create ", s);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* echo [-n] args [> file | >> file] */
+int b_echo(char **argv) {
+  int i, fd = 1, len = 0, nl = 1, flags = 0;
+  char *buf, *file = 0;
+  if (argv[1] && str_equal(argv[1], "-n")) {
+    nl = 0;
+    ++argv;
+  }
+  for (i = 1; argv[i]; ++i) {
+    if (argv[i][0] == '>') {
+      flags = argv[i][1] == '>' ? O_APPEND : O_TRUNC;
+      file = argv[i] + (flags == O_APPEND ? 2 : 1);
+      if (!*file) {
+        file = argv[i + 1];
+      }
+      if (!file || (file == argv[i + 1] ? argv[i + 2] : argv[i + 1])) {
+        return NOBUILTIN; /* only one trailing redirection */
+      }
+      argv[i] = 0;
+      break;
+    }
+    len += str_len(argv[i]) + 1;
+  }
+  buf = alloca(len + 1);
+  for (i = 1, len = 0; argv[i]; ++i) {
+    len += str_copy(buf + len, argv[i]);
+    buf[len++] = argv[i + 1] ? ' ' : '\n';
+  }
+  if (!nl && len) {
+    --len;
+  } else if (nl && !len) {
+    buf[len++] = '\n';
+  }
+  if (file && (fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0666)) == -1) {
+    carpsys("could not open ", file);
+    return 1;
+  }
+  i = write(fd, buf, len) != len;
+  if (i) {
+    carpsys("could not write ", file ? file : "stdout");
+  }
+  if (file) {
+    close(fd);
+  }
+  return i;
+}
+
+/* mount [-n] [-t type] [-o options] source target */
+int b_mount(char **argv) {
+  static const struct {
+    const char *name;
+    unsigned long set, clear;
+  } opts[] = {
+    {"defaults", 0, 0},       {"ro", MS_RDONLY, 0},      {"rw", 0, MS_RDONLY},
+    {"nosuid", MS_NOSUID, 0}, {"suid", 0, MS_NOSUID},    {"nodev", MS_NODEV, 0},
+    {"dev", 0, MS_NODEV},     {"noexec", MS_NOEXEC, 0},  {"exec", 0, MS_NOEXEC},
+    {"sync", MS_SYNCHRONOUS, 0}, {"async", 0, MS_SYNCHRONOUS},
+    {"remount", MS_REMOUNT, 0}, {"bind", MS_BIND, 0},  {"rbind", MS_BIND | MS_REC, 0},
+    {"noatime", MS_NOATIME, 0}, {"nodiratime", MS_NODIRATIME, 0},
+    {"relatime", MS_RELATIME, 0}, {"strictatime", MS_STRICTATIME, 0},
+  };
+  unsigned long flags = 0;
+  char *type = 0, *data = 0, *o = 0;
+  int i, len = 0;
+  for (++argv; *argv && argv[0][0] == '-'; ++argv) {
+    if (str_equal(*argv, "-n")) {
+      continue;
+    }
+    if (!argv[1] || argv[0][2] || (argv[0][1] != 't' && argv[0][1] != 'o') || (argv[0][1] == 'o' && o)) {
+      return NOBUILTIN;
+    }
+    if (argv[0][1] == 't') {
+      type = *++argv;
+    } else {
+      o = *++argv;
+    }
+  }
+  if (!argv[0] || !argv[1] || argv[2]) {
+    return NOBUILTIN;
+  }
+  if (o) {
+    data = alloca(str_len(o) + 1);
+    str_copy(data, o); /* keep argv intact for mount(8) */
+    o = data;
+    while (*o) {
+      char *opt = o;
+      o += str_chr(o, ',');
+      if (*o) {
+        *o++ = 0;
+      }
+      for (i = 0; i < (int)(sizeof opts / sizeof opts[0]); ++i) {
+        if (str_equal(opt, opts[i].name)) {
+          flags = (flags | opts[i].set) & ~opts[i].clear;
+          break;
+        }
+      }
+      if (i < (int)(sizeof opts / sizeof opts[0])) {
+        continue;
+      }
+      if (str_equal(opt, "auto") || str_equal(opt, "noauto") || str_equal(opt, "nofail") ||
+          str_equal(opt, "user") || str_equal(opt, "users") || str_equal(opt, "_netdev") ||
+          (opt[0] == 'x' && opt[1] == '-')) {
+        return NOBUILTIN; /* handled by mount(8) itself */
+      }
+      if (len) {
+        data[len++] = ',';
+      }
+      len += str_copy(data + len, opt);
+    }
+    data[len] = 0;
+  }
+  if (!type && !(flags & (MS_BIND | MS_REMOUNT))) {
+    return NOBUILTIN; /* mount(8) would guess the type or look up fstab */
+  }
+  if (mount(argv[0], argv[1], type, flags, len ? data : 0) == -1) {
+    carpsys("could not mount ", argv[1]);
+    return 32;
+  }
+  /* a bind mount ignores the other flags, like mount(8) apply them by a remount */
+  if ((flags & MS_BIND) && !(flags & MS_REMOUNT) && (flags & ~(MS_BIND | MS_REC)) &&
+      mount(0, argv[1], 0, MS_REMOUNT | MS_BIND | (flags & ~MS_REC), 0) == -1) {
+    carpsys("could not remount ", argv[1]);
+    umount(argv[1]);
+    return 32;
+  }
+  return 0;
+}
+
+/* ln -s[f] target link */
+int b_ln(char **argv) {
+  struct stat ss;
+  int force;
+  if (!argv[1] || !argv[2] || !argv[3] || argv[4]) {
+    return NOBUILTIN;
+  }
+  force = str_equal(argv[1], "-sf") || str_equal(argv[1], "-fs");
+  if (!force && !str_equal(argv[1], "-s")) {
+    return NOBUILTIN;
+  }
+  if (!stat(argv[3], &ss) && S_ISDIR(ss.st_mode)) {
+    return NOBUILTIN; /* ln links into an existing directory, also through a symlink */
+  }
+  if (force) {
+    unlink(argv[3]);
+  }
+  if (symlink(argv[2], argv[3]) == -1) {
+    carpsys("could not link ", argv[3]);
+    return 1;
+  }
+  return 0;
+}
+
+/* sleep seconds[.fraction] */
+int b_sleep(char **argv) {
+  struct timespec ts = {0, 0};
+  long scale = 100000000;
+  char *s;
+  if (!argv[1] || argv[2] || !*argv[1]) {
+    return NOBUILTIN;
+  }
+  for (s = argv[1]; *s >= '0' && *s <= '9'; ++s) {
+    ts.tv_sec = ts.tv_sec * 10 + *s - '0';
+  }
+  if (*s == '.') {
+    for (++s; *s >= '0' && *s <= '9'; ++s, scale /= 10) {
+      ts.tv_nsec += (*s - '0') * scale;
+    }
+  }
+  if (*s) {
+    return NOBUILTIN;
+  }
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    ;
+  }
+  return 0;
+}
+
+/* chmod octal-mode file... */
+int b_chmod(char **argv) {
+  mode_t mode = 0;
+  char *s;
+  if (!argv[1] || !argv[2] || !*argv[1]) {
+    return NOBUILTIN;
+  }
+  for (s = argv[1]; *s >= '0' && *s <= '7'; ++s) {
+    mode = mode * 8 + *s - '0';
+  }
+  if (*s || mode > 07777) {
+    return NOBUILTIN;
+  }
+  for (argv += 2; *argv; ++argv) {
+    if (chmod(*argv, mode) == -1) {
+      carpsys("could not chmod ", *argv);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* hostname name */
+int b_hostname(char **argv) {
+  if (!argv[1] || argv[2] || argv[1][0] == '-') {
+    return NOBUILTIN;
+  }
+  if (sethostname(argv[1], str_len(argv[1])) == -1) {
+    carpsys("could not set hostname");
+    return 1;
+  }
+  return 0;
+}
+
+struct {
+  const char *name;
+  int (*run)(char **argv);
+} builtins[] = {
+  {"mkdir", b_mkdir}, {"echo", b_echo},   {"mount", b_mount},       {"ln", b_ln},
+  {"sleep", b_sleep}, {"chmod", b_chmod}, {"hostname", b_hostname}, {0, 0},
+};
+
+/* reap one background command, return -1 if there is none */
+int reap() {
+  struct rusage ru;
+  int i, status;
+  pid_t pid;
+  if (!njobs) {
+    return -1;
+  }
+  if ((pid = wait4(-1, &status, 0, &ru)) == -1) {
+    diesys(1, "waitpid failed");
+  }
+  status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  for (i = 0; i < njobs; ++i) {
+    if (jobs[i] == pid) {
+      trace_end(jobtrace[i], status, &ru);
+      --njobs;
+      jobs[i] = jobs[njobs];
+      jobtrace[i] = jobtrace[njobs];
+      break;
+    }
+  }
+  if (!jobstatus) {
+    jobstatus = status;
+  }
+  return 0;
+}
+
+/* wait for all background commands, return the first failure */
+int waitjobs() {
+  int r;
+  while (!reap()) {
+    ;
   }
-  return -1;
+  r = jobstatus;
+  jobstatus = 0;
+  return r;
 }
 
-int spawn(char **argv, int last) {
+int spawn(char **argv, int last, int background) {
   int i;
   if (str_equal(argv[0], "cd")) {
     if (argv[1]) {
@@ -55,6 +484,25 @@ int spawn(char **argv, int last) {
     }
     return 0;
   }
+  if (str_equal(argv[0], "wait")) {
+    return waitjobs();
+  }
+  if (!background) {
+    for (i = 0; builtins[i].name; ++i) {
+      if (str_equal(argv[0], builtins[i].name)) {
+        int r = builtins[i].run(argv);
+        if (r != NOBUILTIN) {
+          return r;
+        }
+        break;
+      }
+    }
+  } else {
+    while (njobs >= maxjobs) {
+      reap();
+    }
+    last = 0;
+  }
   if (!last) {
     if ((i = fork()) == -1) {
       diesys(1, "cannot fork");
@@ -70,7 +518,12 @@ int spawn(char **argv, int last) {
     }
     _exit(1);
   }
-  if (waitpid(i, &i, 0) == -1) {
+  if (background) {
+    jobtrace[njobs] = curtrace;
+    jobs[njobs++] = i;
+    return 0;
+  }
+  if (wait4(i, &i, 0, &spawnru) == -1) {
     diesys(1, "waitpid failed");
   }
   if (!WIFEXITED(i)) {
@@ -80,16 +533,15 @@ int spawn(char **argv, int last) {
 }
 
 int run(char *s, int last) {
-  int i, spaces;
+  int i, spaces, background = 0;
   char **argv, **next;
-  ;
   for (i = spaces = 0; s[i]; ++i) {
     if (s[i] == ' ') {
       ++spaces;
     }
   }
-  next = argv = alloca((spaces + 1) * sizeof(char *));
-  memset(argv, 0, (spaces + 1) * sizeof(char *));
+  next = argv = alloca((spaces + 2) * sizeof(char *));
+  memset(argv, 0, (spaces + 2) * sizeof(char *));
   while (*s) {
     while (*s && isspace(*s)) {
       ++s;
@@ -133,12 +585,29 @@ int run(char *s, int last) {
   }
   *++next = 0;
 
-  return spawn(argv, last);
+  /* a trailing & runs the command in the background */
+  for (i = 0; argv[i] && *argv[i]; ++i) {
+    ;
+  }
+  if (i > 1 && str_equal(argv[i - 1], "&")) {
+    argv[i - 1] = 0;
+    background = 1;
+  }
+  if (!trace) {
+    return spawn(argv, last, background);
+  }
+  curtrace = trace_begin(argv);
+  memset(&spawnru, 0, sizeof spawnru);
+  i = spawn(argv, 0, background);
+  if (!background) {
+    trace_end(curtrace, i, &spawnru);
+  }
+  return i;
 }
 
 int execute(char *s) {
   char *start;
-  int r;
+  int i, r;
   r = 0;
   while (*s) {
     int last;
@@ -173,14 +642,37 @@ int execute(char *s) {
     } else {
       last = 1;
     }
-    r = run(start, last);
-    if (r != 0 && !continueonerror) {
+    r = run(start, last && !njobs);
+    if ((r != 0 || jobstatus) && !continueonerror) {
       break;
     }
   }
-  return r;
+  i = waitjobs();
+  return r ? r : i;
 }
 
+/* read a pipe or other file without a size into a growing buffer */
+char *slurp(int fd) {
+  unsigned long len = 0, alloc = 0;
+  char *buf = 0;
+  long r;
+  do {
+    if (len == alloc) {
+      if (!(buf = realloc(buf, (alloc = alloc * 2 + 4096) + 1))) {
+        die(1, "out of memory");
+      }
+    }
+    if ((r = read(fd, buf + len, alloc - len)) == -1) {
+      diesys(1, "read error");
+    }
+    len += r;
+  } while (r > 0);
+  buf[len] = 0;
+  return buf;
+}
+
+/* the script is mapped privately since execute() modifies it in place,
+ * and stays mapped as exported variables point into it */
 int batch(char *s) {
   struct stat ss;
   int fd = open(s, O_RDONLY | O_CLOEXEC);
@@ -191,14 +683,16 @@ int batch(char *s) {
   if (fstat(fd, &ss) == -1) {
     diesys(1, "could not stat ", s);
   }
-  if (ss.st_size > 32768) {
-    die(1, "file ", s, " is too large");
-  }
-  map = alloca(ss.st_size + 1);
-  if (read(fd, map, ss.st_size) != (long)ss.st_size) {
-    diesys(1, "read error");
+  if (!S_ISREG(ss.st_mode)) {
+    map = slurp(fd);
+  } else {
+    /* reserve one more zero byte behind the file, then map the file over it */
+    map = mmap(0, ss.st_size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED ||
+        (ss.st_size && mmap(map, ss.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+      diesys(1, "could not map ", s);
+    }
   }
-  map[ss.st_size] = 0;
   close(fd);
 
   return execute(map);
@@ -208,21 +702,44 @@ int main(int argc, char *argv[], char *env[]) {
   int r;
   (void)argc;
   if (argc < 2) {
-    die(1, "usage: serdo [-c] filename");
+    die(1, "usage: serdo [-c] [-t] [-j jobs] filename");
   }
   errmsg_iam("serdo");
-  for (envc = 0; envc < MAXENV && env[envc]; ++envc) {
+  for (envc = 0; env[envc]; ++envc) {
+    ;
+  }
+  envalloc = envc + 64;
+  if (!(envp = (char **)malloc(envalloc * sizeof(char *)))) {
+    die(1, "out of memory");
+  }
+  for (envc = 0; env[envc]; ++envc) {
     envp[envc] = env[envc];
   }
   envp[envc] = 0;
-  if (str_equal(argv[1], "-c")) {
-    continueonerror = 1;
-    ++argv;
-  }
-  while (*++argv) {
-    if ((r = batch(*argv))) {
-      return r;
+  for (; argv[1] && argv[1][0] == '-'; ++argv) {
+    if (str_equal(argv[1], "-c")) {
+      continueonerror = 1;
+    } else if (str_equal(argv[1], "-t")) {
+      trace = 1;
+    } else if (str_equal(argv[1], "-j") && argv[2]) {
+      maxjobs = atoi(argv[2]);
+      ++argv;
+      if (maxjobs < 1 || maxjobs > MAXJOBS) {
+        maxjobs = MAXJOBS;
+      }
+    } else {
+      break;
     }
   }
-  return 0;
+  if ((tracefile = getenv("SERDO_TRACE"))) {
+    trace = 1;
+  }
+  r = 0;
+  while (*++argv && !(r = batch(*argv))) {
+    ;
+  }
+  if (trace) {
+    trace_report();
+  }
+  return r;
 }
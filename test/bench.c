@@ -0,0 +1,203 @@
+/* microbenchmarks of the neoinit hot paths, run by make bench
+ *
+ * neoinit.c is compiled in to reach its internals. Each benchmark prints one
+ * line: name, parameter (- if none), iterations and nanoseconds per operation,
+ * separated by spaces. */
+
+#define main neoinit_main
+#include "../neoinit.c"
+#undef main
+
+#define NAME_MAX_LEN 32
+
+static char tmpdir[] = "/tmp/neobench.XXXXXX";
+static volatile unsigned long sink; /* keeps results alive */
+
+static unsigned long nsnow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *param, unsigned long iters, unsigned long ns) {
+  printf("%s %s %lu %.1f\n", name, param, iters, (double)ns / iters);
+}
+
+/* add services service-<n> up to count, as loadservice would without a directory */
+static void bench_fill(int count) {
+  char name[NAME_MAX_LEN];
+  sv_t cold;
+  memset(&cold, 0, sizeof(sv_t));
+  cold.sid_father = -1;
+  cold.sid_log = -1;
+  cold.pidfd = -1;
+  cold.exitcode = -1;
+  cold.__stdout = 1;
+  while (sv_max + 1 < count) {
+    snprintf(name, sizeof(name), "service-%d", sv_max + 1);
+    int sid = addsv(name, 0, &cold);
+    if (sid < 0) {
+      fprintf(stderr, "bench: out of memory\n");
+      exit(1);
+    }
+    sv.pid[sid] = 1000 + sid;
+  }
+}
+
+static void bench_lookup(int count) {
+  char param[16];
+  char *names = (char *)malloc(count * NAME_MAX_LEN);
+  unsigned long iters = 2000000;
+  unsigned long t;
+  snprintf(param, sizeof(param), "%d", count);
+  bench_fill(count);
+  for (int i = 0; i < count; ++i) {
+    snprintf(names + i * NAME_MAX_LEN, NAME_MAX_LEN, "service-%d", (int)((i * 7919UL) % count));
+  }
+  t = nsnow();
+  for (unsigned long i = 0; i < iters; ++i) {
+    sink += findservice(names + (i % count) * NAME_MAX_LEN);
+  }
+  report("findservice", param, iters, nsnow() - t);
+  t = nsnow();
+  for (unsigned long i = 0; i < iters; ++i) {
+    sink += findservice("no-such-service");
+  }
+  report("findservice_miss", param, iters, nsnow() - t);
+  iters = 20000000 / count + 100;
+  t = nsnow();
+  for (unsigned long i = 0; i < iters; ++i) {
+    sink += findbypid(1000 + (i * 7919UL) % count);
+  }
+  report("findbypid", param, iters, nsnow() - t);
+  free(names);
+}
+
+static void bench_config() {
+  static const char *file[] = {
+      "depends", "network\nsyslog\nmount/var\nmount/home\ndbus\n#comment\nudev\ntime\n",
+      "environ", "PATH=/sbin:/bin:/usr/sbin:/usr/bin\nHOME=/root\nLANG=C.UTF-8\nTERM=linux\n"
+                 "OPTS=--foreground --no-daemon\nLOGLEVEL=info\nUSER=daemon\n",
+      "params",  "--config\n/etc/daemon.conf\n--port\n8080\n-v\n"};
+  unsigned long iters = 200000;
+  if (chdir(tmpdir)) {
+    return;
+  }
+  for (int f = 0; f < 3; ++f) {
+    unsigned long len = str_len(file[2 * f + 1]);
+    char *copy = (char *)malloc(len + 1);
+    int fd = open(file[2 * f], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, file[2 * f + 1], len) != len || close(fd)) {
+      fprintf(stderr, "bench: could not write %s\n", file[2 * f]);
+      exit(1);
+    }
+    unsigned long t = nsnow();
+    for (unsigned long i = 0; i < iters; ++i) {
+      unsigned long n = 0;
+      memcpy(copy, file[2 * f + 1], len + 1);
+      char **v = split(copy, '\n', &n, 2, 1);
+      sink += n;
+      free(v);
+    }
+    report("split", file[2 * f], iters, nsnow() - t);
+    t = nsnow();
+    for (unsigned long i = 0; i < iters / 4; ++i) {
+      unsigned long n = 0;
+      char *data = 0;
+      if (!openreadclose((char *)file[2 * f], &data, &n)) {
+        sink += n;
+        free(data);
+      }
+    }
+    report("openreadclose", file[2 * f], iters / 4, nsnow() - t);
+    free(copy);
+  }
+}
+
+static void bench_fmt() {
+  char tmp[FMT_ULONG + 1];
+  unsigned long iters = 10000000;
+  unsigned long t = nsnow();
+  for (unsigned long i = 0; i < iters; ++i) {
+    sink += fmt_ulong(tmp, i * 2654435761UL);
+  }
+  report("fmt_ulong", "-", iters, nsnow() - t);
+  t = nsnow();
+  for (unsigned long i = 0; i < iters; ++i) {
+    sink += fmt_long(tmp, (long)(i * 2654435761UL) - (1L << 40));
+  }
+  report("fmt_long", "-", iters, nsnow() - t);
+}
+
+/* queries as neorc sends them for the services of the table, replies to /dev/null */
+static void bench_control() {
+  static const char ops[] = "pujd";
+  char buf[BUFSIZE + 1];
+  unsigned long iters = 500000;
+  outfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  for (int o = 0; ops[o]; ++o) {
+    char param[2] = {ops[o], 0};
+    unsigned long t = nsnow();
+    for (unsigned long i = 0; i < iters; ++i) {
+      buf[0] = ops[o];
+      long len = 1 + snprintf(buf + 1, BUFSIZE, "service-%lu", (i * 7919UL) % (sv_max + 1));
+      control(buf, len);
+    }
+    report("control", param, iters, nsnow() - t);
+  }
+  close(outfd);
+}
+
+/* fork and exec of a service running /bin/true */
+static void bench_spawn() {
+  unsigned long iters = 500;
+  unsigned long forked = 0;
+  char dir[sizeof(tmpdir) + 8];
+  snprintf(dir, sizeof(dir), "%s/spawn", tmpdir);
+  if (mkdir(dir, 0755) || chdir(dir) || symlink("/bin/true", "run")) {
+    fprintf(stderr, "bench: could not create %s\n", dir);
+    exit(1);
+  }
+  bench_fill(sv_max + 2);
+  int sid = sv_max;
+  unsigned long t = nsnow();
+  for (unsigned long i = 0; i < iters; ++i) {
+    unsigned long t0 = nsnow();
+    int status = 0;
+    if (forkandexec(sid, 0, 0)) {
+      fprintf(stderr, "bench: fork failed\n");
+      exit(1);
+    }
+    forked += nsnow() - t0;
+    waitpid(sv.pid[sid], &status, 0);
+  }
+  report("forkandexec", "-", iters, forked);
+  report("spawn_exit", "-", iters, nsnow() - t);
+  unlink("run");
+  if (chdir(tmpdir)) {
+    return;
+  }
+  rmdir(dir);
+}
+
+int main() {
+  if (!mkdtemp(tmpdir)) {
+    fprintf(stderr, "bench: could not create %s\n", tmpdir);
+    return 1;
+  }
+  printf("# name param iterations ns/op\n");
+  for (int count = 100; count <= 100000; count *= 10) {
+    bench_lookup(count);
+  }
+  bench_config();
+  bench_fmt();
+  bench_control();
+  bench_spawn();
+  unlink("depends");
+  unlink("environ");
+  unlink("params");
+  if (!chdir("/")) {
+    rmdir(tmpdir);
+  }
+  return 0;
+}
@@ -0,0 +1,336 @@
+/* end to end boot benchmark, run by make bootbench
+ *
+ * Generates a service tree under NEOROOT (BOOTROOT of the Makefile), starts
+ * test/bootneoinit on it as an ordinary process and reports the time until
+ * all services are up, the peak fds and rss of neoinit and the control query
+ * throughput while churn services respawn.
+ *
+ * usage: bootbench [-n services] [-D depth] [-i fan-in] [-o fan-out]
+ *                  [-l log %] [-s sync %] [-r churn] [-q seconds] [-b neoinit]
+ *
+ * The services form depth layers, each service depends on fan-in services of
+ * the layer before, the layer widths grow by fan-out / fan-in so that a service
+ * has fan-out dependents on average. Services run sleep, the log percentage of
+ * them have a log service running cat and the sync percentage are oneshots
+ * running true that neoinit waits for. Churn services run true and respawn.
+ * default depends on all of them. The result is printed as "key value" lines. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../djb/str.h"
+#include "../neoinit.h"
+
+#define BOOT_TIMEOUT 60 /* s to wait for all services */
+#define MAX_DEPTH    64
+
+static int services = 1000, depth = 4, fanin = 2, fanout = 2;
+static int logpct = 10, syncpct = 5, churn = 0, seconds = 2;
+static char *neoinit = "test/bootneoinit";
+
+static pid_t pid;
+static int infd = -1, outfd = -1;
+static int width[MAX_DEPTH];
+static unsigned long peak_fds;
+
+static unsigned long usnow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void die(const char *what) {
+  fprintf(stderr, "bootbench: %s: %s\n", what, strerror(errno));
+  if (pid > 0) {
+    kill(-pid, SIGKILL);
+  }
+  exit(1);
+}
+
+static void put(const char *fn, const char *data) {
+  int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || write(fd, data, strlen(data)) != strlen(data) || close(fd)) {
+    die(fn);
+  }
+}
+
+static void link_run(const char *dir, const char *target) {
+  char fn[PATH_MAX];
+  snprintf(fn, sizeof(fn), "%s/run", dir);
+  if (symlink(target, fn)) {
+    die(fn);
+  }
+}
+
+/* split services over the layers, widths grow by fanout / fanin */
+static void layers() {
+  double ratio = (double)fanout / fanin;
+  double weight = 1, sum = 0;
+  int left = services;
+  for (int k = 0; k < depth; ++k) {
+    sum += weight;
+    weight *= ratio;
+  }
+  weight = 1;
+  for (int k = 0; k < depth; ++k) {
+    int w = k == depth - 1 ? left : (int)(services * weight / sum + 0.5);
+    if (w < 1) {
+      w = 1;
+    }
+    if (w > left - (depth - 1 - k)) {
+      w = left - (depth - 1 - k);
+    }
+    width[k] = w;
+    left -= w;
+    weight *= ratio;
+  }
+}
+
+static int rmentry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void tree() {
+  char dir[64], fn[96];
+  unsigned long alloc = (services + churn) * 16 + 1;
+  char *deps = (char *)malloc(alloc);
+  char *all = (char *)malloc(alloc);
+  unsigned long nall = 0;
+  if (!deps || !all) {
+    die("malloc");
+  }
+  nftw(NEOROOT, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+  if (mkdir(NEOROOT, 0755) || chdir(NEOROOT) || mkfifo("in", 0600) || mkfifo("out", 0600) ||
+      mkdir("default", 0755)) {
+    die(NEOROOT);
+  }
+  for (int k = 0, first = 0; k < depth; first += width[k++]) {
+    for (int j = 0; j < width[k]; ++j) {
+      int svc = first + j;
+      snprintf(dir, sizeof(dir), "s%d", svc);
+      nall += sprintf(all + nall, "%s\n", dir);
+      if (mkdir(dir, 0755)) {
+        die(dir);
+      }
+      if (k) {
+        unsigned long n = 0;
+        int prev = first - width[k - 1];
+        for (int m = 0; m < fanin && m < width[k - 1]; ++m) {
+          n += sprintf(deps + n, "s%d\n", prev + (j * fanin + m) % width[k - 1]);
+        }
+        snprintf(fn, sizeof(fn), "%s/depends", dir);
+        put(fn, deps);
+      }
+      if (svc * 37 % 100 < syncpct) {
+        snprintf(fn, sizeof(fn), "%s/sync", dir);
+        put(fn, "");
+        link_run(dir, "/bin/true");
+        continue;
+      }
+      link_run(dir, "/bin/sleep");
+      snprintf(fn, sizeof(fn), "%s/params", dir);
+      put(fn, "3600\n");
+      if (svc * 53 % 100 < logpct) {
+        snprintf(fn, sizeof(fn), "%s/log", dir);
+        if (mkdir(fn, 0755)) {
+          die(fn);
+        }
+        link_run(fn, "/bin/cat");
+      }
+    }
+  }
+  for (int c = 0; c < churn; ++c) {
+    snprintf(dir, sizeof(dir), "c%d", c);
+    nall += sprintf(all + nall, "%s\n", dir);
+    snprintf(fn, sizeof(fn), "%s/respawn", dir);
+    if (mkdir(dir, 0755)) {
+      die(dir);
+    }
+    put(fn, "");
+    link_run(dir, "/bin/true");
+  }
+  put("default/depends", all);
+  free(deps);
+  free(all);
+}
+
+/* send a control request, return the length of the reply */
+static int query(char op, const char *service, char *reply, int size) {
+  char buf[BUFSIZE];
+  int len = snprintf(buf, sizeof(buf), "%c%s", op, service);
+  if (write(infd, buf, len) != len) {
+    die("write");
+  }
+  if ((len = read(outfd, reply, size - 1)) <= 0) {
+    die("read");
+  }
+  reply[len] = 0;
+  return len;
+}
+
+static void sample_fds() {
+  char fn[32];
+  unsigned long n = 0;
+  snprintf(fn, sizeof(fn), "/proc/%d/fd", pid);
+  DIR *d = opendir(fn);
+  if (!d) {
+    return;
+  }
+  while (readdir(d)) {
+    ++n;
+  }
+  closedir(d);
+  if (n - 2 > peak_fds) {
+    peak_fds = n - 2;
+  }
+}
+
+static long peak_rss() {
+  char fn[32], line[128];
+  long kb = -1;
+  snprintf(fn, sizeof(fn), "/proc/%d/status", pid);
+  FILE *f = fopen(fn, "r");
+  if (!f) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, "VmHWM:", 6)) {
+      kb = atol(line + 6);
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+/* wait until every service is active or finished, return the us it took */
+static unsigned long boot(unsigned long t0) {
+  char name[32], reply[64];
+  int next = 0;
+  while (next < services) {
+    snprintf(name, sizeof(name), "s%d", next);
+    char *at = query('p', name, reply, sizeof(reply)) > 1 ? strchr(reply, '@') : 0;
+    int state = at ? atoi(at + 1) : SID_INIT;
+    if (state == SID_ACTIVE || state == SID_FINISHED) {
+      ++next;
+      continue;
+    }
+    sample_fds();
+    if (usnow() - t0 > BOOT_TIMEOUT * 1000000UL) {
+      errno = ETIMEDOUT;
+      die(name);
+    }
+    usleep(1000);
+  }
+  return usnow() - t0;
+}
+
+int main(int argc, char *argv[]) {
+  char path[PATH_MAX], reply[64], name[32];
+  int opt;
+  while ((opt = getopt(argc, argv, "n:D:i:o:l:s:r:q:b:")) != -1) {
+    switch (opt) {
+    case 'n':
+      services = atoi(optarg);
+      break;
+    case 'D':
+      depth = atoi(optarg);
+      break;
+    case 'i':
+      fanin = atoi(optarg);
+      break;
+    case 'o':
+      fanout = atoi(optarg);
+      break;
+    case 'l':
+      logpct = atoi(optarg);
+      break;
+    case 's':
+      syncpct = atoi(optarg);
+      break;
+    case 'r':
+      churn = atoi(optarg);
+      break;
+    case 'q':
+      seconds = atoi(optarg);
+      break;
+    case 'b':
+      neoinit = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: bootbench [-n services] [-D depth] [-i fan-in] [-o fan-out]\n"
+                      "                 [-l log %%] [-s sync %%] [-r churn] [-q seconds] [-b neoinit]\n");
+      return 1;
+    }
+  }
+  if (depth < 1 || depth > MAX_DEPTH || services < depth || fanin < 1 || fanout < 1 || churn < 0) {
+    fprintf(stderr, "bootbench: invalid parameters\n");
+    return 1;
+  }
+  if (!realpath(neoinit, path) || !(neoinit = strdup(path))) {
+    die(neoinit);
+  }
+  layers();
+  tree();
+
+  unsigned long t0 = usnow();
+  switch (pid = fork()) {
+  case -1:
+    die("fork");
+  case 0:
+    setpgid(0, 0);
+    execl(neoinit, "neoinit", (char *)0);
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  if ((infd = open(NEOROOT "/in", O_WRONLY | O_CLOEXEC)) < 0 ||
+      (outfd = open(NEOROOT "/out", O_RDONLY | O_CLOEXEC)) < 0) {
+    die(NEOROOT);
+  }
+  unsigned long boot_us = boot(t0);
+
+  unsigned long queries = 0;
+  unsigned long t = usnow();
+  unsigned long end = t + seconds * 1000000UL;
+  for (unsigned long now = t; now < end; now = usnow()) {
+    for (int i = 0; i < 100; ++i, ++queries) {
+      snprintf(name, sizeof(name), "s%lu", queries * 7919 % services);
+      query('p', name, reply, sizeof(reply));
+    }
+    if (queries % 1000 == 0) {
+      sample_fds();
+    }
+  }
+  t = usnow() - t;
+  sample_fds();
+  long rss = peak_rss();
+
+  query('A', "", reply, sizeof(reply));
+  kill(-pid, SIGTERM);
+  kill(-pid, SIGKILL);
+  waitpid(pid, 0, 0);
+
+  printf("services %d\n", services);
+  printf("layers");
+  for (int k = 0; k < depth; ++k) {
+    printf(" %d", width[k]);
+  }
+  printf("\nfanin %d\nfanout %d\n", fanin, fanout);
+  printf("boot_ms %lu.%03lu\n", boot_us / 1000, boot_us % 1000);
+  printf("peak_fds %lu\n", peak_fds);
+  printf("peak_rss_kb %ld\n", rss);
+  printf("queries %lu\n", queries);
+  printf("query_qps %lu\n", t ? queries * 1000000 / t : 0);
+  nftw(NEOROOT, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
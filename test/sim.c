@@ -0,0 +1,379 @@
+/* deterministic simulation of neoinit with many services, run by make sim
+ *
+ * neoinit.c is compiled in and its process, clock and file operations are
+ * replaced by a model: the services are generated from a seed, run for random
+ * durations on a virtual clock and fail, exit and respond to signals as the
+ * model says, no process is forked. The service directories are created under
+ * NEOROOT (SIMROOT of the Makefile, on tmpfs) for the flag files neoinit looks
+ * up there, the depends files are served from memory.
+ *
+ * usage: sim [-n services] [-d max deps] [-o oneshot %] [-f fail %]
+ *            [-t max run ms] [-g spawn max] [-l limit ms] [-s seed]
+ *
+ * Daemons respawn, oneshots finish. Each run fails with the fail percentage,
+ * a failing daemon exits with an error after its run time. Service n depends
+ * on up to max deps of the services below n, default on all of them. The
+ * result is printed as "key value" lines, all but real_ms are the same for the
+ * same parameters. */
+
+#define main neoinit_main
+#include "../neoinit.c"
+#undef main
+
+#include <ftw.h>
+
+#define SIM_PID   100        /* first simulated pid */
+#define SIM_NEVER ULONG_MAX  /* exit time of a process running until it is killed */
+#define SIM_TERM  10000      /* us a process takes to exit on SIGTERM */
+#define SIM_EPOCH 1700000000 /* wall clock at virtual time 0 */
+#define SIM_RUN   1000       /* first draw of the runs of a service */
+
+typedef struct {
+  int svc; /* model service, services for default */
+  int status;
+  int reaped;
+  unsigned long exit_us;
+} proc_t;
+
+/* exit of a process, stale if the process was killed earlier */
+typedef struct {
+  unsigned long us;
+  pid_t pid;
+} event_t;
+
+static int services = 10000, ndeps = 3, oneshot = 30, fail = 5;
+static unsigned long run_ms = 1000, limit_ms = 60000, seed = 1;
+
+static unsigned long vnow = 1000000; /* virtual us */
+static proc_t *procs;
+static int nprocs, procs_alloc;
+static event_t *heap;
+static int nheap, heap_alloc;
+static int *runs; /* by model service */
+static int alive, started;
+static unsigned long spawns, exits, failures, kills, steps, last_start_us;
+static unsigned long real_us;
+
+/* splitmix64 of the seed, a service and a draw */
+static unsigned long rnd(unsigned long svc, unsigned long draw) {
+  unsigned long z = seed + svc * 0x9e3779b97f4a7c15UL + draw * 0xd1b54a32d192ed03UL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+  return z ^ (z >> 31);
+}
+
+static int isoneshot(int svc) {
+  return svc == services || rnd(svc, 0) % 100 < oneshot;
+}
+
+static void *sim_grow(void *v, int *alloc, int n, unsigned long size) {
+  if (n < *alloc) {
+    return v;
+  }
+  *alloc = *alloc ? *alloc * 2 : 1024;
+  if (!(v = realloc(v, *alloc * size))) {
+    fprintf(stderr, "sim: out of memory\n");
+    exit(1);
+  }
+  return v;
+}
+
+static void heap_push(unsigned long us, pid_t pid) {
+  heap = (event_t *)sim_grow(heap, &heap_alloc, nheap, sizeof(event_t));
+  int i = nheap++;
+  for (; i && heap[(i - 1) / 2].us > us; i = (i - 1) / 2) {
+    heap[i] = heap[(i - 1) / 2];
+  }
+  heap[i].us = us;
+  heap[i].pid = pid;
+}
+
+static void heap_pop() {
+  event_t last = heap[--nheap];
+  int i = 0;
+  for (int c = 1; c < nheap; i = c, c = 2 * c + 1) {
+    if (c + 1 < nheap && heap[c + 1].us < heap[c].us) {
+      ++c;
+    }
+    if (last.us <= heap[c].us) {
+      break;
+    }
+    heap[i] = heap[c];
+  }
+  heap[i] = last;
+}
+
+/* drop the exits of processes that were killed earlier */
+static void heap_clean() {
+  while (nheap) {
+    proc_t *p = &procs[heap[0].pid - SIM_PID];
+    if (!p->reaped && p->exit_us == heap[0].us) {
+      return;
+    }
+    heap_pop();
+  }
+}
+
+static proc_t *proc(pid_t pid) {
+  if (pid < SIM_PID || pid >= SIM_PID + nprocs || procs[pid - SIM_PID].reaped) {
+    return 0;
+  }
+  return &procs[pid - SIM_PID];
+}
+
+static int svcof(int sid) {
+  char *name = svname(sid);
+  return name[0] == 's' ? atoi(name + 1) : services;
+}
+
+static pid_t sim_fork(int sid, int pause) {
+  int svc = svcof(sid);
+  int run = runs[svc]++;
+  pid_t pid = SIM_PID + nprocs;
+  procs = (proc_t *)sim_grow(procs, &procs_alloc, nprocs, sizeof(proc_t));
+  proc_t *p = &procs[nprocs++];
+  p->svc = svc;
+  p->reaped = 0;
+  p->status = svc < services && rnd(svc, SIM_RUN + 2 * run) % 100 < fail ? 1 << 8 : 0;
+  p->exit_us = vnow + (pause ? 500000 : 0);
+  if (svc < services) {
+    p->exit_us += 1000 * (1 + rnd(svc, SIM_RUN + 2 * run + 1) % run_ms);
+  }
+  if (!isoneshot(svc) && !p->status) {
+    p->exit_us = SIM_NEVER;
+  } else {
+    heap_push(p->exit_us, pid);
+  }
+  if (!run && svc < services) {
+    started++;
+    last_start_us = vnow;
+  }
+  spawns++;
+  alive++;
+  return pid;
+}
+
+static void reap(proc_t *p, int *status, struct rusage *ru) {
+  p->reaped = 1;
+  alive--;
+  exits++;
+  if (p->status) {
+    failures++;
+  }
+  *status = p->status;
+  if (ru) {
+    memset(ru, 0, sizeof(struct rusage));
+  }
+}
+
+static pid_t sim_wait4(pid_t pid, int *status, int options, struct rusage *ru) {
+  if (pid > 0) {
+    /* a sync start, wait for the process */
+    proc_t *p = proc(pid);
+    if (!p) {
+      errno = ECHILD;
+      return -1;
+    }
+    if (p->exit_us == SIM_NEVER) {
+      p->exit_us = vnow + limit_ms * 1000;
+    }
+    if (p->exit_us > vnow) {
+      vnow = p->exit_us;
+    }
+    reap(p, status, ru);
+    return pid;
+  }
+  heap_clean();
+  if (nheap && heap[0].us <= vnow) {
+    pid = heap[0].pid;
+    heap_pop();
+    reap(&procs[pid - SIM_PID], status, ru);
+    return pid;
+  }
+  if (alive) {
+    return 0;
+  }
+  errno = ECHILD;
+  return -1;
+}
+
+static int sim_kill(pid_t pid, int sig) {
+  proc_t *p = proc(pid);
+  if (!p) {
+    errno = ESRCH;
+    return -1;
+  }
+  if (sig == SIGTERM || sig == SIGKILL) {
+    unsigned long us = sig == SIGKILL ? vnow : vnow + SIM_TERM;
+    if (us < p->exit_us) {
+      p->exit_us = us;
+      p->status = sig;
+      heap_push(us, pid);
+      kills++;
+    }
+  }
+  return 0;
+}
+
+/* serves the depends files of the model, there are no other files */
+static int sim_openreadclose(char *fn, char **buf, unsigned long *len) {
+  char cwd[PATH_MAX];
+  char *x;
+  if (strcmp(fn, "depends") || !getcwd(cwd, sizeof(cwd)) || !(x = strrchr(cwd, '/'))) {
+    errno = ENOENT;
+    return -1;
+  }
+  int svc = !strcmp(x + 1, "default") ? services : atoi(x + 2);
+  int n = svc == services ? services : svc ? rnd(svc, 1) % (ndeps + 1) : 0;
+  unsigned long size = 0;
+  if (!n || !(*buf = (char *)malloc(n * (FMT_ULONG + 2) + 1))) {
+    errno = ENOENT;
+    return -1;
+  }
+  for (int i = 0; i < n; ++i) {
+    int dep = svc == services ? i : rnd(svc, 2 + i) % svc;
+    (*buf)[size++] = 's';
+    size += fmt_ulong(*buf + size, dep);
+    (*buf)[size++] = '\n';
+  }
+  (*buf)[size] = 0;
+  *len = size;
+  return 0;
+}
+
+static int sim_clock_gettime(clockid_t clk, struct timespec *ts) {
+  ts->tv_sec = vnow / 1000000;
+  ts->tv_nsec = vnow % 1000000 * 1000;
+  return 0;
+}
+
+static time_t sim_time(time_t *t) {
+  time_t now = SIM_EPOCH + vnow / 1000000;
+  if (t) {
+    *t = now;
+  }
+  return now;
+}
+
+static int rmentry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  return remove(path);
+}
+
+/* create the service directories, daemons have a respawn file */
+static void sim_tree() {
+  char name[FMT_ULONG + 2] = "s";
+  nftw(NEOROOT, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+  if (mkdir(NEOROOT, 0755) || chdir(NEOROOT) || mkdir("default", 0755)) {
+    fprintf(stderr, "sim: could not create " NEOROOT "\n");
+    exit(1);
+  }
+  for (int svc = 0; svc < services; ++svc) {
+    name[1 + fmt_ulong(name + 1, svc)] = 0;
+    if (mkdir(name, 0755)) {
+      fprintf(stderr, "sim: could not create %s\n", name);
+      exit(1);
+    }
+    if (!isoneshot(svc)) {
+      int fd = -1;
+      if (chdir(name) || (fd = open("respawn", O_WRONLY | O_CREAT, 0644)) < 0 || close(fd) ||
+          chdir("..")) {
+        fprintf(stderr, "sim: could not create %s/respawn\n", name);
+        exit(1);
+      }
+    }
+  }
+}
+
+static unsigned long realus() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void sim_report() {
+  printf("services %d\n", services);
+  printf("seed %lu\n", seed);
+  printf("virtual_ms %lu\n", (vnow - 1000000) / 1000);
+  printf("started %d\n", started);
+  printf("last_start_ms %lu\n", last_start_us ? (last_start_us - 1000000) / 1000 : 0);
+  printf("spawns %lu\n", spawns);
+  printf("exits %lu\n", exits);
+  printf("failures %lu\n", failures);
+  printf("kills %lu\n", kills);
+  printf("running %d\n", alive);
+  printf("steps %lu\n", steps);
+  printf("real_ms %lu\n", (realus() - real_us) / 1000);
+  fflush(stdout);
+  nftw(NEOROOT, rmentry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:o:f:t:g:l:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      services = atoi(optarg);
+      break;
+    case 'd':
+      ndeps = atoi(optarg);
+      break;
+    case 'o':
+      oneshot = atoi(optarg);
+      break;
+    case 'f':
+      fail = atoi(optarg);
+      break;
+    case 't':
+      run_ms = strtoul(optarg, 0, 10);
+      break;
+    case 'g':
+      setenv("NEO_SPAWN_MAX", optarg, 1);
+      break;
+    case 'l':
+      limit_ms = strtoul(optarg, 0, 10);
+      break;
+    case 's':
+      seed = strtoul(optarg, 0, 10);
+      break;
+    default:
+      fprintf(stderr, "usage: sim [-n services] [-d max deps] [-o oneshot %%] [-f fail %%]\n"
+                      "           [-t max run ms] [-g spawn max] [-l limit ms] [-s seed]\n");
+      return 1;
+    }
+  }
+  if (services < 1 || ndeps < 0 || !run_ms || !(runs = (int *)calloc(services + 1, sizeof(int)))) {
+    fprintf(stderr, "sim: invalid parameters\n");
+    return 1;
+  }
+  sim_tree();
+  real_us = realus();
+  sys.fork = sim_fork;
+  sys.wait4 = sim_wait4;
+  sys.kill = sim_kill;
+  sys.openreadclose = sim_openreadclose;
+  sys.clock_gettime = sim_clock_gettime;
+  sys.time = sim_time;
+  spawn_config();
+  atexit(sim_report); /* neoinit exits when all processes did */
+
+  circsweep();
+  startservice(loadservice("default"), 0, -1);
+  unsigned long limit_us = vnow + limit_ms * 1000;
+  for (;;) {
+    unsigned long next = vnow + loop_step() * 1000UL;
+    steps++;
+    heap_clean();
+    if (!nheap && !spawnq_len && !stop_pending && restart_sid < 0) {
+      break; /* only processes running until they are killed are left */
+    }
+    if (nheap && heap[0].us < next) {
+      next = heap[0].us;
+    }
+    if (next > limit_us) {
+      vnow = limit_us;
+      break;
+    }
+    vnow = next;
+  }
+  return 0;
+}